@@ -0,0 +1,203 @@
+#include "DetectionLog.h"
+#include <algorithm>
+#include <cstring>
+#include <opencv2/imgproc/imgproc.hpp>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char log_magic[8] = { 'P', 'P', 'T', 'D', 'L', 'O', 'G', '1' };
+
+struct DetectionLog::Header
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int record_size;
+	int width, height; // of the frames
+	char reserved[40];
+};
+
+static_assert(sizeof(DetectionLog::Record) == 144, "the record layout is part of the file format");
+
+DetectionLog::DetectionLog() : out(nullptr), written(0), base(nullptr), length(0), records(nullptr), count(0)
+#ifdef _WIN32
+	, file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#else
+	, fd(-1)
+#endif
+{
+	static_assert(sizeof(Header) == 64, "the header is 64 bytes");
+}
+
+DetectionLog::~DetectionLog()
+{
+	close();
+}
+
+bool DetectionLog::create(const string& path, Size frame_size)
+{
+	close();
+	out = fopen(path.c_str(), "wb");
+	if (!out) return false;
+	Header header = {};
+	memcpy(header.magic, log_magic, sizeof(log_magic));
+	header.version = 1;
+	header.record_size = sizeof(Record);
+	header.width = frame_size.width;
+	header.height = frame_size.height;
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+	{
+		close();
+		return false;
+	}
+	frame_dims = frame_size;
+	return true;
+}
+
+bool DetectionLog::open(const string& path)
+{
+	close();
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	size_t size = (size_t)file_size.QuadPart;
+	if (size >= sizeof(Header))
+	{
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) base = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+	}
+#else
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	fstat(fd, &st);
+	size_t size = (size_t)st.st_size;
+	if (size >= sizeof(Header))
+	{
+		void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) base = (unsigned char*)p;
+	}
+#endif
+	if (!base)
+	{
+		close();
+		return false;
+	}
+	length = size;
+
+	const Header* header = (const Header*)base;
+	if (memcmp(header->magic, log_magic, sizeof(log_magic)) != 0 || header->version != 1 || header->record_size != sizeof(Record))
+	{
+		close();
+		return false;
+	}
+	frame_dims = Size(header->width, header->height);
+	records = (const Record*)(base + sizeof(Header));
+	count = (length - sizeof(Header)) / sizeof(Record); // a torn last record is left out
+	return true;
+}
+
+void DetectionLog::close()
+{
+	if (out) fclose(out);
+	out = nullptr;
+	written = 0;
+#ifdef _WIN32
+	if (base) UnmapViewOfFile(base);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (base) munmap(base, length);
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+#endif
+	base = nullptr;
+	length = 0;
+	records = nullptr;
+	count = 0;
+	frame_dims = Size();
+}
+
+DetectionLog::Record DetectionLog::make_record(const vector<Point2f>& points, double timestamp)
+{
+	Record record = {};
+	record.timestamp = timestamp;
+	if (points.size() != 4) return record;
+	for (int i = 0; i < 4; ++i)
+	{
+		record.points[2 * i] = points[i].x;
+		record.points[2 * i + 1] = points[i].y;
+	}
+	record.width = (int)norm(points[1] - points[0]);
+	record.height = (int)norm(points[2] - points[0]);
+	vector<Point2f> unit = { Point2f(0, 0), Point2f(1, 0), Point2f(0, 1), Point2f(1, 1) };
+	Mat h = getPerspectiveTransform(points, unit);
+	for (int i = 0; i < 9; ++i)
+		record.homography[i] = h.at<double>(i / 3, i % 3);
+	return record;
+}
+
+bool DetectionLog::append(Record record)
+{
+	lock_guard<mutex> guard(lock);
+	if (!out) return false;
+	if (record.timestamp < 0) record.timestamp = (double)written;
+	if (fwrite(&record, sizeof(record), 1, out) != 1) return false;
+	++written;
+	return true;
+}
+
+bool DetectionLog::flush()
+{
+	lock_guard<mutex> guard(lock);
+	return out && fflush(out) == 0;
+}
+
+size_t DetectionLog::appended() const
+{
+	lock_guard<mutex> guard(lock);
+	return written;
+}
+
+long long DetectionLog::find(double timestamp) const
+{
+	auto end = records + count;
+	auto it = upper_bound(records, end, timestamp, [](double t, const Record& r) { return t < r.timestamp; });
+	return (long long)(it - records) - 1;
+}
+
+vector<Point2f> DetectionLog::points(const Record& record)
+{
+	vector<Point2f> result;
+	for (int i = 0; i < 4; ++i)
+		result.push_back(Point2f(record.points[2 * i], record.points[2 * i + 1]));
+	return result;
+}
+
+Mat DetectionLog::homography(const Record& record, Size size)
+{
+	if (size.area() == 0) size = Size(record.width, record.height);
+	Mat unit(3, 3, CV_64F, (void*)record.homography);
+	Mat scale = (Mat_<double>(3, 3) << size.width, 0, 0, 0, size.height, 0, 0, 0, 1);
+	return scale * unit;
+}
+
+Mat DetectionLog::warp(const Mat& frame, size_t index, Size size) const
+{
+	if (index >= count || frame.empty()) return Mat();
+	const Record& record = records[index];
+	if (size.area() == 0) size = Size(record.width, record.height);
+	if (size.area() == 0) return Mat();
+	Mat result;
+	warpPerspective(frame, result, homography(record, size), size);
+	return result;
+}
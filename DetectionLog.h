@@ -0,0 +1,89 @@
+#ifndef __DETECTIONLOG_H
+#define __DETECTIONLOG_H
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+using namespace cv;
+using namespace std;
+
+// Per-frame detection results in a binary sidecar file, so a video or batch
+// job can be rendered again at another output size without detecting again.
+// The file is a 64-byte header and then fixed-size records in frame order:
+// record i starts at 64 + i * sizeof(Record), so the frame number is the index
+// and timestamps, which only grow, are found by bisection. Records are only
+// ever appended and a reader ignores a partly written last one. create/append
+// write through stdio and may be shared by several PPTRestore objects; open
+// maps the file read-only and hands records out in place.
+class DetectionLog
+{
+public:
+	enum Flags : unsigned int
+	{
+		Found = 1,     // confidence reached min_confidence when it was recorded
+		Fallback = 2,  // some corner is an image corner
+		Truncated = 4  // the detection ran out of time
+	};
+
+	struct Record
+	{
+		double timestamp;      // seconds for video frames, the frame number otherwise
+		double homography[9];  // frame pixels to the unit square, row major
+		float points[8];       // x0 y0 .. x3 y3: left_top, right_top, left_down, right_down
+		int width, height;     // natural output size, from the top and left sides of the quad
+		float confidence;
+		float preprocess_ms, lines_ms, corners_ms; // stage timings of the detection
+		unsigned int flags;
+		int verified_corners;
+	};
+
+	DetectionLog();
+	~DetectionLog();
+	DetectionLog(const DetectionLog&) = delete;
+	DetectionLog& operator=(const DetectionLog&) = delete;
+
+	bool create(const string& path, Size frame_size); // write, replaces an existing file
+	bool open(const string& path);                    // read-only, mapped
+	void close();
+
+	// points and homography from the quad, everything else zero
+	static Record make_record(const vector<Point2f>& points, double timestamp);
+	// a negative timestamp is replaced by the frame number
+	bool append(Record record);
+	bool flush();
+
+	// records are read back only after open: size() is 0 while writing
+	size_t size() const { return count; }
+	size_t appended() const;
+	Size frame_size() const { return frame_dims; }
+	const Record& operator[](size_t index) const { return records[index]; }
+	// last record at or before timestamp, -1 if there is none
+	long long find(double timestamp) const;
+
+	static vector<Point2f> points(const Record& record);
+	// frame to output mapping for an output of the given size, the natural size if empty
+	static Mat homography(const Record& record, Size size = Size());
+	// the bare perspective warp of a frame; PPTRestore::get_image with points()
+	// gives the enhanced output instead
+	Mat warp(const Mat& frame, size_t index, Size size = Size()) const;
+private:
+	struct Header;
+
+	FILE* out;
+	size_t written;
+	mutable mutex lock;
+	Size frame_dims;
+	unsigned char* base;
+	size_t length;
+	const Record* records;
+	size_t count;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+};
+
+#endif
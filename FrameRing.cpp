@@ -0,0 +1,223 @@
+#include "FrameRing.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char ring_magic[8] = { 'P', 'P', 'T', 'R', 'I', 'N', 'G', '1' };
+
+// head and tail on their own cache lines, the producer writes one and the consumer the other
+struct FrameRing::Header
+{
+	char magic[8];
+	int slots, width, height, channels;
+	unsigned long long slot_bytes;
+	unsigned long long data_offset;
+	alignas(64) atomic<unsigned long long> head; // slots published
+	alignas(64) atomic<unsigned long long> tail; // slots released
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring indices have to be lock-free to work across processes");
+
+FrameRing::FrameRing() : header(nullptr), base(nullptr), length(0)
+#ifdef _WIN32
+	, mapping(nullptr)
+#endif
+{
+}
+
+FrameRing::~FrameRing()
+{
+	close();
+}
+
+static string shm_name(const string& name)
+{
+#ifdef _WIN32
+	return "Local\\" + name;
+#else
+	return name.empty() || name[0] != '/' ? "/" + name : name;
+#endif
+}
+
+bool FrameRing::map(const string& name, size_t size, bool create)
+{
+#ifdef _WIN32
+	if (create)
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+			(DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xffffffff), shm_name(name).c_str());
+	else
+		mapping = OpenFileMappingA(FILE_MAP_WRITE, FALSE, shm_name(name).c_str());
+	if (!mapping) return false;
+	base = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (!base) return false;
+	if (!size)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		VirtualQuery(base, &info, sizeof(info));
+		size = info.RegionSize;
+	}
+#else
+	int fd = shm_open(shm_name(name).c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+	if (fd < 0) return false;
+	struct stat st;
+	if (create ? ftruncate(fd, (off_t)size) != 0 : fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	if (!create) size = (size_t)st.st_size;
+	void* p = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	::close(fd);
+	if (p == MAP_FAILED) return false;
+	base = (unsigned char*)p;
+#endif
+	length = size;
+	header = (Header*)base;
+	return true;
+}
+
+bool FrameRing::create(const string& name, int slots, Size size, int channels)
+{
+	close();
+	if (slots <= 0 || size.width <= 0 || size.height <= 0 || channels < 1 || channels > 4) return false;
+	remove(name);
+	const size_t page = 4096;
+	size_t data_offset = (sizeof(Header) + slots * sizeof(double) + page - 1) / page * page;
+	size_t frame_bytes = (size_t)size.width * size.height;
+	if (frame_bytes / size.width != (size_t)size.height || frame_bytes > (SIZE_MAX - 63) / channels) return false;
+	size_t slot_bytes = (frame_bytes * channels + 63) / 64 * 64;
+	if (slot_bytes > (SIZE_MAX - data_offset) / slots) return false;
+	if (!map(name, data_offset + slots * slot_bytes, true))
+	{
+		close();
+		return false;
+	}
+	header = new (base) Header();
+	memcpy(header->magic, ring_magic, sizeof(ring_magic));
+	header->slots = slots;
+	header->width = size.width;
+	header->height = size.height;
+	header->channels = channels;
+	header->slot_bytes = slot_bytes;
+	header->data_offset = data_offset;
+	header->head = 0;
+	header->tail = 0;
+	return true;
+}
+
+bool FrameRing::open(const string& name)
+{
+	close();
+	if (!map(name, 0, false) || length < sizeof(Header) || memcmp(header->magic, ring_magic, sizeof(ring_magic)) != 0 || !valid())
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+// The header may come from a stale ring or another program: every field is
+// checked, without overflow, before slot() relies on it.
+bool FrameRing::valid() const
+{
+	typedef unsigned long long u64;
+	const Header& h = *header;
+	if (h.slots <= 0 || h.width <= 0 || h.height <= 0 || h.channels < 1 || h.channels > 4) return false;
+	// slot_bytes >= width * height * channels, which can't overflow in 64 bits after the division
+	if (h.slot_bytes / (u64)h.channels < (u64)h.width * (u64)h.height) return false;
+	// the timestamps fit between the header and the first slot
+	if (h.data_offset < sizeof(Header) + (u64)h.slots * sizeof(double) || h.data_offset > length) return false;
+	return h.slot_bytes <= ((u64)length - h.data_offset) / (u64)h.slots;
+}
+
+void FrameRing::close()
+{
+#ifdef _WIN32
+	if (base) UnmapViewOfFile(base);
+	if (mapping) CloseHandle(mapping);
+	mapping = nullptr;
+#else
+	if (base) munmap(base, length);
+#endif
+	header = nullptr;
+	base = nullptr;
+	length = 0;
+}
+
+void FrameRing::remove(const string& name)
+{
+#ifndef _WIN32
+	shm_unlink(shm_name(name).c_str());
+#endif
+}
+
+// per-slot timestamps follow the header, the slots start on the next page
+double* FrameRing::timestamps()
+{
+	return (double*)(header + 1);
+}
+
+Mat FrameRing::slot(unsigned long long index)
+{
+	unsigned char* data = base + header->data_offset + (index % header->slots) * header->slot_bytes;
+	return Mat(header->height, header->width, CV_8UC(header->channels), data);
+}
+
+bool FrameRing::begin_write(Mat& frame)
+{
+	unsigned long long head = header->head.load(memory_order_relaxed);
+	if (head - header->tail.load(memory_order_acquire) >= (unsigned long long)header->slots) return false;
+	frame = slot(head);
+	return true;
+}
+
+void FrameRing::end_write(double timestamp)
+{
+	unsigned long long head = header->head.load(memory_order_relaxed);
+	timestamps()[head % header->slots] = timestamp;
+	header->head.store(head + 1, memory_order_release);
+}
+
+bool FrameRing::begin_read(Mat& frame, double* timestamp)
+{
+	unsigned long long tail = header->tail.load(memory_order_relaxed);
+	if (tail == header->head.load(memory_order_acquire)) return false;
+	frame = slot(tail);
+	if (timestamp) *timestamp = timestamps()[tail % header->slots];
+	return true;
+}
+
+void FrameRing::end_read()
+{
+	unsigned long long tail = header->tail.load(memory_order_relaxed);
+	header->tail.store(tail + 1, memory_order_release);
+}
+
+size_t FrameRing::available() const
+{
+	return (size_t)(header->head.load(memory_order_acquire) - header->tail.load(memory_order_acquire));
+}
+
+int FrameRing::slots() const
+{
+	return header->slots;
+}
+
+Size FrameRing::size() const
+{
+	return Size(header->width, header->height);
+}
+
+int FrameRing::channels() const
+{
+	return header->channels;
+}
@@ -0,0 +1,52 @@
+#ifndef __FRAMERING_H
+#define __FRAMERING_H
+#include <string>
+#include <opencv2/core/core.hpp>
+using namespace cv;
+using namespace std;
+
+// Fixed-size 8-bit frames in a named shared memory ring, for one producer and
+// one consumer, usually in different processes. The producer fills the slot
+// begin_write hands out and publishes it with end_write; the consumer reads the
+// oldest published slot from begin_read in place and frees it with end_read.
+// The two indices are lock-free atomics in the mapped header, so nothing is
+// locked and no frame is ever copied by the ring itself.
+class FrameRing
+{
+public:
+	FrameRing();
+	~FrameRing();
+	FrameRing(const FrameRing&) = delete;
+	FrameRing& operator=(const FrameRing&) = delete;
+
+	bool create(const string& name, int slots, Size size, int channels); // replaces a stale ring of that name, 1 to 4 channels
+	bool open(const string& name);                                       // attach to an existing ring
+	void close();
+	static void remove(const string& name);
+
+	// false when the ring is full or empty, the Mat is a view on the slot
+	bool begin_write(Mat& slot);
+	void end_write(double timestamp = 0);
+	bool begin_read(Mat& slot, double* timestamp = nullptr);
+	void end_read();
+
+	size_t available() const; // published and not yet read
+	int slots() const;
+	Size size() const;
+	int channels() const;
+private:
+	struct Header;
+	bool map(const string& name, size_t size, bool create);
+	bool valid() const;
+	Mat slot(unsigned long long index);
+	double* timestamps();
+
+	Header* header;
+	unsigned char* base;
+	size_t length;
+#ifdef _WIN32
+	void* mapping;
+#endif
+};
+
+#endif
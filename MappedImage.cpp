@@ -0,0 +1,152 @@
+#include "MappedImage.h"
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <climits>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+MappedImage::MappedImage() : base(nullptr), length(0)
+#ifdef _WIN32
+	, file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#else
+	, fd(-1)
+#endif
+{
+}
+
+MappedImage::~MappedImage()
+{
+	close();
+}
+
+// reads one header field, skipping whitespace and # comments; false past INT_MAX
+static bool read_field(const unsigned char* p, size_t length, size_t& pos, int& value)
+{
+	while (pos < length && (isspace(p[pos]) || p[pos] == '#'))
+	{
+		if (p[pos] == '#')
+			while (pos < length && p[pos] != '\n') ++pos;
+		else
+			++pos;
+	}
+	if (pos == length || !isdigit(p[pos])) return false;
+	value = 0;
+	while (pos < length && isdigit(p[pos]))
+	{
+		int digit = p[pos++] - '0';
+		if (value > (INT_MAX - digit) / 10) return false;
+		value = value * 10 + digit;
+	}
+	return true;
+}
+
+bool MappedImage::open(const string& path)
+{
+	close();
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	size_t size = (size_t)file_size.QuadPart;
+#else
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	fstat(fd, &st);
+	size_t size = (size_t)st.st_size;
+#endif
+	if (size < 3 || !map(size, false))
+	{
+		close();
+		return false;
+	}
+
+	int width, height, maxval, channels = base[1] == '6' ? 3 : base[1] == '5' ? 1 : 0;
+	size_t pos = 2;
+	if (base[0] != 'P' || channels == 0 ||
+		!read_field(base, length, pos, width) || !read_field(base, length, pos, height) ||
+		!read_field(base, length, pos, maxval) || width <= 0 || height <= 0 || maxval <= 0 || maxval > 255 || pos == length)
+	{
+		close();
+		return false;
+	}
+	++pos; // the single whitespace character before the pixels
+	if ((length - pos) / height / channels < (size_t)width)
+	{
+		close();
+		return false;
+	}
+	view = Mat(height, width, CV_8UC(channels), base + pos);
+	return true;
+}
+
+bool MappedImage::create(const string& path, Size size, int channels)
+{
+	close();
+	if (size.width <= 0 || size.height <= 0 || (channels != 1 && channels != 3)) return false;
+	char header[64];
+	int header_length = sprintf(header, "P%c\n%d %d\n255\n", channels == 1 ? '5' : '6', size.width, size.height);
+	size_t total = header_length + (size_t)size.width * size.height * channels;
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+#else
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t)total) != 0)
+	{
+		close();
+		return false;
+	}
+#endif
+	if (!map(total, true))
+	{
+		close();
+		return false;
+	}
+	memcpy(base, header, header_length);
+	view = Mat(size, CV_8UC(channels), base + header_length);
+	return true;
+}
+
+bool MappedImage::map(size_t size, bool writable)
+{
+#ifdef _WIN32
+	mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xffffffff), nullptr);
+	if (!mapping) return false;
+	base = (unsigned char*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+	if (!base) return false;
+#else
+	void* p = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) return false;
+	base = (unsigned char*)p;
+#endif
+	length = size;
+	return true;
+}
+
+void MappedImage::close()
+{
+	view.release();
+#ifdef _WIN32
+	if (base) UnmapViewOfFile(base);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (base) munmap(base, length);
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+#endif
+	base = nullptr;
+	length = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __MAPPEDIMAGE_H
+#define __MAPPEDIMAGE_H
+#include <string>
+#include <opencv2/core/core.hpp>
+using namespace cv;
+using namespace std;
+
+// A binary PPM (P6) or PGM (P5) file mapped into memory. mat() is a view on the
+// mapped pixels, nothing is copied; pages are read from and written to the file
+// by the OS as they are touched. Only maxval <= 255 is supported. Channels keep
+// the file's order, so a PPM view is RGB rather than OpenCV's usual BGR.
+class MappedImage
+{
+public:
+	MappedImage();
+	~MappedImage();
+	MappedImage(const MappedImage&) = delete;
+	MappedImage& operator=(const MappedImage&) = delete;
+
+	bool open(const string& path);                               // read-only
+	bool create(const string& path, Size size, int channels);    // read-write, 1 -> PGM, 3 -> PPM
+	void close();
+
+	Mat& mat() { return view; }
+private:
+	bool map(size_t length, bool writable);
+
+	unsigned char* base;
+	size_t length;
+	Mat view;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+};
+
+#endif
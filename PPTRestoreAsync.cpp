@@ -0,0 +1,122 @@
+#include "PPTRestoreAsync.h"
+
+AsyncRestore::AsyncRestore(const PPTRestore& prototype, int workers, size_t capacity) : capacity(max<size_t>(1, capacity))
+{
+	if (workers <= 0) workers = getNumberOfCPUs();
+	for (int i = 0; i < workers; ++i)
+		this->workers.emplace_back([this, prototype] { run(prototype); });
+}
+
+AsyncRestore::~AsyncRestore()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+		for (auto& job : jobs)
+			job.token.cancel();
+	}
+	not_empty.notify_all();
+	not_full.notify_all();
+	for (auto& t : workers)
+		t.join();
+}
+
+bool AsyncRestore::push(Job& job, bool wait)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		if (wait) not_full.wait(guard, [&] { return stopping || jobs.size() < capacity; });
+		if (stopping || jobs.size() >= capacity) return false;
+		jobs.push_back(std::move(job));
+	}
+	not_empty.notify_one();
+	return true;
+}
+
+future<AsyncRestore::Result> AsyncRestore::submit(Mat image, CancelToken token)
+{
+	auto promise = make_shared<std::promise<Result>>();
+	auto result = promise->get_future();
+	submit(image, [promise](Result& r) {
+		if (r.error) promise->set_exception(r.error);
+		else promise->set_value(r);
+	}, token);
+	return result;
+}
+
+bool AsyncRestore::submit(Mat image, Callback done, CancelToken token)
+{
+	Job job{ image, done, token };
+	if (push(job, true)) return true;
+	Result result;
+	result.cancelled = true;
+	done(result);
+	return false;
+}
+
+bool AsyncRestore::try_submit(Mat image, Callback done, CancelToken token)
+{
+	Job job{ image, done, token };
+	return push(job, false);
+}
+
+bool AsyncRestore::try_submit(Mat image, Mat dst, bool warp, Callback done, CancelToken token)
+{
+	Job job{ image, done, token, dst, warp };
+	return push(job, false);
+}
+
+size_t AsyncRestore::pending() const
+{
+	lock_guard<mutex> guard(lock);
+	return jobs.size();
+}
+
+void AsyncRestore::run(const PPTRestore& prototype)
+{
+	PPTRestore ppt(prototype);
+	for (;;)
+	{
+		Job job;
+		{
+			unique_lock<mutex> guard(lock);
+			not_empty.wait(guard, [&] { return stopping || !jobs.empty(); });
+			if (jobs.empty()) return;
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		not_full.notify_one();
+
+		// detect, then warp and enhance, looking at the token in between; an
+		// exception from OpenCV fails this job only, not the worker. Images may
+		// be borrowed, so detection goes through the ImageView overload, which
+		// keeps no header on them.
+		Result result;
+		const atomic<bool>& cancelled = *job.token.flag;
+		try
+		{
+			if (!cancelled)
+			{
+				ppt.set_cancel_flag(&cancelled);
+				result.detection = ppt.detect(PPTRestore::view_of(job.image));
+				ppt.set_cancel_flag(nullptr);
+			}
+			if (!cancelled && job.warp && result.detection.confidence >= ppt.min_confidence())
+			{
+				if (job.dst.empty())
+					result.image = ppt.get_image(job.image, result.detection.points);
+				else if (ppt.get_image(PPTRestore::view_of(job.image), result.detection.points, PPTRestore::view_of(job.dst)))
+					result.image = job.dst;
+			}
+		}
+		catch (...)
+		{
+			ppt.set_cancel_flag(nullptr);
+			result = Result();
+			result.error = current_exception();
+		}
+		result.cancelled = cancelled;
+		if (result.cancelled) result.image.release();
+		job.done(result);
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef __PPTRESTOREASYNC_H
+#define __PPTRESTOREASYNC_H
+#include <functional>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include "PPTRestoreClassHead.h"
+
+// Set from any thread; a job sees it before each stage and inside detect at
+// the deadline checks.
+class CancelToken
+{
+public:
+	CancelToken() : flag(make_shared<atomic<bool>>(false)) {}
+	void cancel() { *flag = true; }
+	bool cancelled() const { return *flag; }
+private:
+	friend class AsyncRestore;
+	shared_ptr<atomic<bool>> flag;
+};
+
+// Event-driven front end: images go into a bounded queue served by a fixed set
+// of worker threads, each with its own copy of a configured PPTRestore, and
+// come back through a future or a callback run on the worker. submit waits
+// for room in the queue, try_submit refuses instead.
+class AsyncRestore
+{
+public:
+	struct Result
+	{
+		PPTRestore::Detection detection;
+		Mat image;              // empty when cancelled, below min_confidence or failed
+		bool cancelled = false;
+		exception_ptr error;    // what the pipeline threw, null on success
+	};
+	typedef function<void(Result&)> Callback;
+
+	// workers <= 0: one per core, meant for ThreadingPolicy::InterImage
+	explicit AsyncRestore(const PPTRestore& prototype, int workers = 0, size_t capacity = 16);
+	~AsyncRestore(); // queued jobs are cancelled, running ones finish
+	AsyncRestore(const AsyncRestore&) = delete;
+	AsyncRestore& operator=(const AsyncRestore&) = delete;
+
+	// the future rethrows an exception thrown by the pipeline
+	future<Result> submit(Mat image, CancelToken token = CancelToken());
+	// false only while shutting down, done is then called as cancelled
+	bool submit(Mat image, Callback done, CancelToken token = CancelToken());
+	// false when the queue is full, done is not called
+	bool try_submit(Mat image, Callback done, CancelToken token = CancelToken());
+	// for callers that place the slide themselves: a non-empty dst gets it
+	// stretched over it as by get_image(ImageView) and comes back as
+	// Result::image; warp false stops after detection
+	bool try_submit(Mat image, Mat dst, bool warp, Callback done, CancelToken token = CancelToken());
+	size_t pending() const;
+private:
+	struct Job
+	{
+		Mat image;
+		Callback done;
+		CancelToken token;
+		Mat dst;
+		bool warp = true;
+	};
+	bool push(Job& job, bool wait);
+	void run(const PPTRestore& prototype);
+
+	size_t capacity;
+	bool stopping = false;
+	deque<Job> jobs;
+	mutable mutex lock;
+	condition_variable not_empty, not_full;
+	vector<thread> workers;
+};
+#endif
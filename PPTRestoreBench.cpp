@@ -0,0 +1,279 @@
+#include "PPTRestoreClassHead.h"
+#include "FrameRing.h"
+#include <atomic>
+#include <thread>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+template<class F>
+double time_ms(F f, int runs)
+{
+	f();
+	int64 start = getTickCount();
+	for (int i = 0; i < runs; ++i)
+		f();
+	return (getTickCount() - start) * 1000.0 / getTickFrequency() / runs;
+}
+
+void bench_sharpen()
+{
+	cout << "sharpen, CV_8UC3" << endl;
+	const Size sizes[] = { Size(1920, 1080), Size(3840, 2160), Size(4000, 3000) };
+	const char* names[] = { "1080p", "4K", "12MP" };
+	Mat kernel = (Mat_<float>(3, 3) << 0, -1, 0, -1, 5, -1, 0, -1, 0);
+	for (int i = 0; i < 3; ++i)
+	{
+		Mat src(sizes[i], CV_8UC3), by_filter2D, by_int;
+		randu(src, Scalar::all(0), Scalar::all(256));
+		double mp = sizes[i].area() / 1e6;
+
+		double t_float = time_ms([&] { filter2D(src, by_filter2D, src.depth(), kernel); }, 10);
+		double t_int = time_ms([&] { sharpen_8u(src, by_int); }, 10);
+		bool identical = norm(by_filter2D, by_int, NORM_INF) == 0;
+
+		cout << names[i] << ": filter2D " << t_float << " ms (" << mp / t_float * 1000 << " MP/s), "
+			<< "sharpen_8u " << t_int << " ms (" << mp / t_int * 1000 << " MP/s), "
+			<< (identical ? "identical" : "MISMATCH") << endl;
+	}
+}
+
+// the pairwise parametric intersection cal_points_with_lines used before LineSet
+void pairwise_intersections(const vector<Vec4f>& lines, Point2f lo, Point2f hi, vector<Point2f>& out)
+{
+	for (int i = 0; i < lines.size(); ++i)
+		for (int j = i + 1; j < lines.size(); ++j)
+		{
+			Point2f o1(lines[i][0], lines[i][1]), o2(lines[j][0], lines[j][1]);
+			Point2f d1 = Point2f(lines[i][2], lines[i][3]) - o1, d2 = Point2f(lines[j][2], lines[j][3]) - o2;
+			Point2f x = o2 - o1;
+			float cross = d1.x*d2.y - d1.y*d2.x;
+			double t1 = (x.x * d2.y - x.y * d2.x) / cross;
+			Point2f c = o1 + d1 * t1;
+			if (c.x < lo.x || c.x > hi.x || c.y < lo.y || c.y > hi.y) continue;
+			out.emplace_back(c);
+		}
+}
+
+void bench_line_geometry()
+{
+	cout << "line geometry" << endl;
+	RNG rng(12345);
+	const Point2f lo(-50, -50), hi(4050, 3050);
+	for (int n : { 100, 1000, 4000 })
+	{
+		vector<Vec4f> lines;
+		for (int i = 0; i < n; ++i)
+			lines.emplace_back(rng.uniform(0.f, 4000.f), rng.uniform(0.f, 3000.f), rng.uniform(0.f, 4000.f), rng.uniform(0.f, 3000.f));
+		double pairs = n * (n - 1) / 2.0;
+
+		vector<Point2f> out;
+		double t_pairwise = time_ms([&] { out.clear(); pairwise_intersections(lines, lo, hi, out); }, 3);
+		double t_set = time_ms([&] { out.clear(); LineSet(lines).intersect_all(lo, hi, out); }, 3);
+		cout << n << " lines, all-pairs intersection: pairwise " << pairs / t_pairwise / 1e3 << " Mpairs/s, "
+			<< "LineSet " << pairs / t_set / 1e3 << " Mpairs/s" << endl;
+
+		vector<Point2f> pts;
+		for (int i = 0; i < 10000; ++i)
+			pts.emplace_back(rng.uniform(0.f, 4000.f), rng.uniform(0.f, 3000.f));
+		LineSet set(lines);
+		vector<float> distances;
+		double t_dist = time_ms([&] { set.min_distances(pts, distances); }, 3);
+		cout << n << " lines, nearest-line distance for 10000 points: "
+			<< pts.size() * (double)n / t_dist / 1e3 << " Mpoint-lines/s" << endl;
+	}
+}
+
+// images/sec through get_points for each threading policy and core budget,
+// using the sample slides in the working directory
+void bench_threading()
+{
+	cout << "threading policy, " << getNumberOfCPUs() << " cores available" << endl;
+	vector<Mat> images;
+	for (auto name : { "ppt1.jpg", "ppt2.jpg", "ppt3.jpg", "ppt4.jpg" })
+	{
+		Mat img = imread(name);
+		if (!img.empty()) images.push_back(img);
+	}
+	if (images.empty())
+	{
+		cout << "no sample images found, skipped" << endl;
+		return;
+	}
+
+	const pair<PPTRestore::ThreadingPolicy, const char*> policies[] = {
+		{ PPTRestore::ThreadingPolicy::InterImage, "inter-image" },
+		{ PPTRestore::ThreadingPolicy::IntraImage, "intra-image" },
+		{ PPTRestore::ThreadingPolicy::Hybrid, "hybrid" }
+	};
+	for (int cores : { 1, 4, 16, 64 })
+	{
+		for (auto policy : policies)
+		{
+			auto budget = PPTRestore::set_threading_policy(policy.first, cores);
+			const int total = max(16, 2 * budget.workers);
+			atomic<int> next(0);
+
+			int64 start = getTickCount();
+			vector<thread> workers;
+			for (int w = 0; w < budget.workers; ++w)
+				workers.emplace_back([&] {
+					PPTRestore ppt;
+					for (int i = next++; i < total; i = next++)
+					{
+						Mat img = images[i % images.size()].clone();
+						ppt.get_points(img);
+					}
+				});
+			for (auto& t : workers)
+				t.join();
+			double seconds = (getTickCount() - start) / getTickFrequency();
+
+			cout << cores << " cores, " << policy.second << " (" << budget.workers << " workers x "
+				<< budget.threads_per_image << " threads): " << total / seconds << " images/s" << endl;
+		}
+	}
+}
+
+#ifndef _WIN32
+static bool send_all(int fd, const uchar* data, size_t n)
+{
+	for (ssize_t k; n > 0; data += k, n -= k)
+		if ((k = send(fd, data, n, 0)) <= 0) return false;
+	return true;
+}
+
+static bool recv_all(int fd, uchar* data, size_t n)
+{
+	for (ssize_t k; n > 0; data += k, n -= k)
+		if ((k = recv(fd, data, n, 0)) <= 0) return false;
+	return true;
+}
+#endif
+
+// frames/s from a capture thread through the rectifier to an output thread,
+// over shared memory rings and over socket pairs, with and without the
+// rectification itself; a transport copy is one pass of a frame through send or recv
+void bench_frame_ring()
+{
+	cout << "frame transport, 1280x720 BGR in and out" << endl;
+	Mat source = imread("ppt1.jpg");
+	if (source.empty())
+	{
+		source = Mat(720, 1280, CV_8UC3, Scalar(60, 60, 60));
+		rectangle(source, Point(240, 120), Point(1040, 600), Scalar(235, 235, 235), -1);
+	}
+	resize(source, source, Size(1280, 720));
+	const Size out_size(1280, 720);
+	const int frames = 200;
+	const size_t in_bytes = source.total() * source.elemSize(), out_bytes = (size_t)out_size.area() * 3;
+
+	for (bool rectify : { false, true })
+	{
+		const char* mode = rectify ? "rectify" : "transport only";
+		PPTRestore ppt;
+		{
+			FrameRing producer, rectifier_in, rectifier_out, consumer;
+			if (!producer.create("ppt_bench_in", 8, source.size(), 3) || !rectifier_in.open("ppt_bench_in") ||
+				!rectifier_out.create("ppt_bench_out", 8, out_size, 3) || !consumer.open("ppt_bench_out"))
+			{
+				cout << "can't create the shared memory rings" << endl;
+				break;
+			}
+			int64 start = getTickCount();
+			thread capture([&] {
+				Mat slot;
+				for (int i = 0; i < frames; ++i)
+				{
+					while (!producer.begin_write(slot)) this_thread::yield();
+					source.copyTo(slot); // stands in for the capture device filling the slot
+					producer.end_write(i);
+				}
+			});
+			atomic<bool> done(false);
+			thread output([&] {
+				Mat slot;
+				while (!done || consumer.available())
+				{
+					if (consumer.begin_read(slot)) consumer.end_read();
+					else this_thread::yield();
+				}
+			});
+			for (int consumed = 0; consumed < frames;)
+			{
+				int n = 0;
+				Mat in, out;
+				double timestamp;
+				if (rectify)
+					n = ppt.rectify_ring(rectifier_in, rectifier_out);
+				else if (rectifier_out.begin_write(out) && rectifier_in.begin_read(in, &timestamp))
+				{
+					rectifier_out.end_write(timestamp);
+					rectifier_in.end_read();
+					n = 1;
+				}
+				consumed += n;
+				if (!n) this_thread::yield();
+			}
+			capture.join();
+			done = true;
+			output.join();
+			double seconds = (getTickCount() - start) / getTickFrequency();
+			cout << mode << ", shared memory ring: " << frames / seconds << " frames/s, 0 transport copies per frame" << endl;
+			FrameRing::remove("ppt_bench_in");
+			FrameRing::remove("ppt_bench_out");
+		}
+#ifndef _WIN32
+		{
+			int in_fds[2], out_fds[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, in_fds) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, out_fds) != 0)
+			{
+				cout << "can't create socket pairs" << endl;
+				break;
+			}
+			atomic<int> copies(0);
+			int64 start = getTickCount();
+			thread capture([&] {
+				for (int i = 0; i < frames && send_all(in_fds[0], source.data, in_bytes); ++i)
+					++copies;
+			});
+			thread output([&] {
+				vector<uchar> buffer(out_bytes);
+				for (int i = 0; i < frames && recv_all(out_fds[1], buffer.data(), out_bytes); ++i)
+					++copies;
+			});
+			Mat frame(source.size(), CV_8UC3), result(out_size, CV_8UC3, Scalar::all(0));
+			for (int i = 0; i < frames; ++i)
+			{
+				if (!recv_all(in_fds[1], frame.data, in_bytes)) break;
+				++copies;
+				if (rectify)
+				{
+					auto detection = ppt.detect(PPTRestore::view_of(frame));
+					if (detection.confidence >= ppt.min_confidence())
+						ppt.get_image(PPTRestore::view_of(frame), detection.points, PPTRestore::view_of(result));
+				}
+				if (!send_all(out_fds[0], result.data, out_bytes)) break;
+				++copies;
+			}
+			capture.join();
+			output.join();
+			double seconds = (getTickCount() - start) / getTickFrequency();
+			for (int fd : { in_fds[0], in_fds[1], out_fds[0], out_fds[1] })
+				close(fd);
+			cout << mode << ", socket pair: " << frames / seconds << " frames/s, "
+				<< (double)copies / frames << " transport copies per frame" << endl;
+		}
+#endif
+	}
+}
+
+int main()
+{
+	bench_sharpen();
+	bench_line_geometry();
+	bench_threading();
+	bench_frame_ring();
+	return 0;
+}
@@ -1,5 +1,12 @@
 ﻿
 #include "PPTRestoreClassHead.h"
+#include "MappedImage.h"
+#include "FrameRing.h"
+#include "DetectionLog.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PPT_SSE2 1
+#endif
 
 template<class T>
 class Types
@@ -65,45 +72,562 @@ ostream& operator<< (ostream& out, const Vec4f& v)
 	return out;
 }
 
+// Diagnostic drawings are recorded as primitives while the pipeline runs and
+// only rasterised by render(), so the normal path never copies or draws on a
+// full-size image. Nothing is recorded unless enabled is set.
+class Overlay
+{
+public:
+	bool enabled = false;
+
+	void points(const string& layer, const vector<Point2f>& pts, const Scalar& color, int radius = 4)
+	{
+		if (!enabled) return;
+		for (auto p : pts)
+			layers[layer].push_back({ Primitive::Circle, { p }, color, radius });
+	}
+
+	void lines(const string& layer, const vector<Vec4f>& segments, const Scalar& color)
+	{
+		if (!enabled) return;
+		for (auto l : segments)
+			layers[layer].push_back({ Primitive::Polyline, { Point2f(l[0], l[1]), Point2f(l[2], l[3]) }, color, 1 });
+	}
+
+	void contour(const string& layer, const vector<Point>& c, const Scalar& color, int thickness = 1)
+	{
+		if (!enabled) return;
+		layers[layer].push_back({ Primitive::Polygon, vector<Point2f>(c.begin(), c.end()), color, thickness });
+	}
+
+	void clear() { layers.clear(); }
+
+	vector<string> names() const
+	{
+		vector<string> res;
+		for (const auto& l : layers)
+			res.push_back(l.first);
+		return res;
+	}
+
+	Mat render(const string& layer, const Mat& background) const
+	{
+		Mat canvas;
+		if (background.channels() == 1)
+			cvtColor(background, canvas, COLOR_GRAY2BGR);
+		else
+			canvas = background.clone();
+		auto it = layers.find(layer);
+		if (it == layers.end()) return canvas;
+		for (const auto& prim : it->second)
+		{
+			switch (prim.kind)
+			{
+			case Primitive::Circle:
+				circle(canvas, prim.pts[0], prim.size, prim.color, -1, 8, 0);
+				break;
+			case Primitive::Polyline:
+			case Primitive::Polygon:
+				for (size_t i = 0; i + 1 < prim.pts.size(); ++i)
+					line(canvas, prim.pts[i], prim.pts[i + 1], prim.color, prim.size, 8);
+				if (prim.kind == Primitive::Polygon && prim.pts.size() > 2)
+					line(canvas, prim.pts.back(), prim.pts.front(), prim.color, prim.size, 8);
+				break;
+			}
+		}
+		return canvas;
+	}
+private:
+	struct Primitive
+	{
+		enum Kind { Circle, Polyline, Polygon } kind;
+		vector<Point2f> pts;
+		Scalar color;
+		int size;
+	};
+	map<string, vector<Primitive>> layers;
+};
+
+// Runs a filter pass over horizontal stripes of src in parallel. Each stripe is
+// a row range of the parent Mat, so OpenCV filters read the real neighbouring
+// rows as border and the result equals a single full-frame pass.
+class RowStripes : public ParallelLoopBody
+{
+public:
+	using Pass = function<void(const Mat& src, Mat& dst)>;
+
+	RowStripes(const Mat& src, Mat& dst, Pass pass) : src(src), dst(dst), pass(pass) {}
+
+	void operator()(const Range& range) const
+	{
+		Mat stripe = dst.rowRange(range.start, range.end);
+		pass(src.rowRange(range.start, range.end), stripe);
+	}
+
+	static void run(const Mat& src, Mat& dst, Pass pass)
+	{
+		dst.create(src.size(), src.type());
+		parallel_for_(Range(0, src.rows), RowStripes(src, dst, pass));
+	}
+private:
+	const Mat& src;
+	Mat& dst;
+	Pass pass;
+};
+
+// 0,-1,0 / -1,5,-1 / 0,-1,0 on 8-bit rows in 16-bit integer arithmetic.
+// The sums are exact, so saturating them gives exactly what filter2D with the
+// float kernel and BORDER_REFLECT_101 produces.
+class Sharpen8U : public ParallelLoopBody
+{
+public:
+	Sharpen8U(const Mat& src, Mat& dst) : src(src), dst(dst) {}
+
+	void operator()(const Range& range) const
+	{
+		const int cn = src.channels();
+		const int width = src.cols * cn;
+		for (int y = range.start; y < range.end; ++y)
+		{
+			const uchar* up = src.ptr(y == 0 ? 1 : y - 1);
+			const uchar* mid = src.ptr(y);
+			const uchar* down = src.ptr(y == src.rows - 1 ? src.rows - 2 : y + 1);
+			uchar* out = dst.ptr(y);
+
+			// first and last pixel reflect around themselves
+			for (int c = 0; c < cn; ++c)
+			{
+				out[c] = at(up, mid, down, c, c + cn, c + cn);
+				int x = width - cn + c;
+				out[x] = at(up, mid, down, x, x - cn, x - cn);
+			}
+
+			int x = cn;
+#ifdef PPT_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			for (; x + 16 <= width - cn; x += 16)
+			{
+				__m128i c = _mm_loadu_si128((const __m128i*)(mid + x));
+				__m128i u = _mm_loadu_si128((const __m128i*)(up + x));
+				__m128i d = _mm_loadu_si128((const __m128i*)(down + x));
+				__m128i l = _mm_loadu_si128((const __m128i*)(mid + x - cn));
+				__m128i r = _mm_loadu_si128((const __m128i*)(mid + x + cn));
+				__m128i lo = _mm_unpacklo_epi8(c, zero), hi = _mm_unpackhi_epi8(c, zero);
+				lo = _mm_add_epi16(_mm_slli_epi16(lo, 2), lo);
+				hi = _mm_add_epi16(_mm_slli_epi16(hi, 2), hi);
+				lo = _mm_sub_epi16(lo, _mm_add_epi16(_mm_unpacklo_epi8(u, zero), _mm_unpacklo_epi8(d, zero)));
+				hi = _mm_sub_epi16(hi, _mm_add_epi16(_mm_unpackhi_epi8(u, zero), _mm_unpackhi_epi8(d, zero)));
+				lo = _mm_sub_epi16(lo, _mm_add_epi16(_mm_unpacklo_epi8(l, zero), _mm_unpacklo_epi8(r, zero)));
+				hi = _mm_sub_epi16(hi, _mm_add_epi16(_mm_unpackhi_epi8(l, zero), _mm_unpackhi_epi8(r, zero)));
+				_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(lo, hi));
+			}
+#endif
+			for (; x < width - cn; ++x)
+				out[x] = at(up, mid, down, x, x - cn, x + cn);
+		}
+	}
+private:
+	static uchar at(const uchar* up, const uchar* mid, const uchar* down, int x, int left, int right)
+	{
+		return saturate_cast<uchar>(5 * mid[x] - up[x] - down[x] - mid[left] - mid[right]);
+	}
+
+	const Mat& src;
+	Mat& dst;
+};
+
+void sharpen_8u(const Mat& src, Mat& dst)
+{
+	if (src.depth() != CV_8U || src.rows < 2 || src.cols < 2)
+	{
+		Mat kernel = (Mat_<float>(3, 3) << 0, -1, 0, -1, 5, -1, 0, -1, 0);
+		filter2D(src, dst, src.depth(), kernel);
+		return;
+	}
+	dst.create(src.size(), src.type());
+	parallel_for_(Range(0, src.rows), Sharpen8U(src, dst));
+}
+
+static Vec3f homogeneous_line(const Vec4f& l)
+{
+	// cross product of (x1, y1, 1) and (x2, y2, 1), normalised on (a, b)
+	float a = l[1] - l[3], b = l[2] - l[0], c = l[0] * l[3] - l[2] * l[1];
+	float n = sqrtf(a * a + b * b);
+	// a degenerate segment meets nothing and is far from everything
+	if (n == 0) return Vec3f(0, 0, 1e30f);
+	return Vec3f(a / n, b / n, c / n);
+}
+
+LineSet::LineSet(const vector<Vec4f>& segments)
+{
+	a.reserve(segments.size());
+	b.reserve(segments.size());
+	c.reserve(segments.size());
+	for (const auto& l : segments)
+		push_back(l);
+}
+
+void LineSet::push_back(const Vec4f& segment)
+{
+	Vec3f h = homogeneous_line(segment);
+	a.push_back(h[0]);
+	b.push_back(h[1]);
+	c.push_back(h[2]);
+}
+
+float LineSet::cos_angle(const Vec4f& l1, const Vec4f& l2)
+{
+	Vec3f h1 = homogeneous_line(l1), h2 = homogeneous_line(l2);
+	return fabs(h1[0] * h2[0] + h1[1] * h2[1]);
+}
+
+void LineSet::intersect_all(Point2f lo, Point2f hi, vector<Point2f>& out, int first, int last) const
+{
+	// with unit normals w is the sine of the angle between the lines
+	const float parallel = 1e-6f;
+	const int n = (int)size();
+	if (last < 0 || last > n) last = n;
+	for (int i = first; i < last; ++i)
+	{
+		const float ai = a[i], bi = b[i], ci = c[i];
+		int j = i + 1;
+#ifdef PPT_SSE2
+		const __m128i sign = _mm_set1_epi32(0x7fffffff);
+		const __m128 va = _mm_set1_ps(ai), vb = _mm_set1_ps(bi), vc = _mm_set1_ps(ci);
+		const __m128 vlox = _mm_set1_ps(lo.x), vloy = _mm_set1_ps(lo.y), vhix = _mm_set1_ps(hi.x), vhiy = _mm_set1_ps(hi.y);
+		const __m128 veps = _mm_set1_ps(parallel);
+		for (; j + 4 <= n; j += 4)
+		{
+			__m128 aj = _mm_loadu_ps(&a[j]), bj = _mm_loadu_ps(&b[j]), cj = _mm_loadu_ps(&c[j]);
+			__m128 w = _mm_sub_ps(_mm_mul_ps(va, bj), _mm_mul_ps(vb, aj));
+			__m128 x = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(vb, cj), _mm_mul_ps(vc, bj)), w);
+			__m128 y = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(vc, aj), _mm_mul_ps(va, cj)), w);
+			__m128 keep = _mm_cmpgt_ps(_mm_and_ps(w, _mm_castsi128_ps(sign)), veps);
+			keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(x, vlox), _mm_cmple_ps(x, vhix)));
+			keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(y, vloy), _mm_cmple_ps(y, vhiy)));
+			int mask = _mm_movemask_ps(keep);
+			if (!mask) continue;
+			float xs[4], ys[4];
+			_mm_storeu_ps(xs, x);
+			_mm_storeu_ps(ys, y);
+			for (int k = 0; k < 4; ++k)
+				if (mask & (1 << k)) out.emplace_back(xs[k], ys[k]);
+		}
+#endif
+		for (; j < n; ++j)
+		{
+			float w = ai * b[j] - bi * a[j];
+			if (fabs(w) <= parallel) continue;
+			float x = (bi * c[j] - ci * b[j]) / w, y = (ci * a[j] - ai * c[j]) / w;
+			if (x >= lo.x && x <= hi.x && y >= lo.y && y <= hi.y)
+				out.emplace_back(x, y);
+		}
+	}
+}
+
+void LineSet::min_distances(const vector<Point2f>& pts, vector<float>& out) const
+{
+	out.assign(pts.size(), FLT_MAX);
+	const int n = (int)size(), count = (int)pts.size();
+	int i = 0;
+#ifdef PPT_SSE2
+	// four points at a time against one line
+	const __m128i sign = _mm_set1_epi32(0x7fffffff);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 p01 = _mm_loadu_ps(&pts[i].x), p23 = _mm_loadu_ps(&pts[i + 2].x);
+		__m128 x = _mm_shuffle_ps(p01, p23, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 y = _mm_shuffle_ps(p01, p23, _MM_SHUFFLE(3, 1, 3, 1));
+		__m128 best = _mm_set1_ps(FLT_MAX);
+		for (int j = 0; j < n; ++j)
+		{
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[j]), x), _mm_mul_ps(_mm_set1_ps(b[j]), y)), _mm_set1_ps(c[j]));
+			best = _mm_min_ps(best, _mm_and_ps(d, _mm_castsi128_ps(sign)));
+		}
+		_mm_storeu_ps(&out[i], best);
+	}
+#endif
+	for (; i < count; ++i)
+		for (int j = 0; j < n; ++j)
+			out[i] = min(out[i], fabs(a[j] * pts[i].x + b[j] * pts[i].y + c[j]));
+}
+
+ResultCache::ResultCache(size_t max_bytes, bool keep_output) : max_bytes(max_bytes), keep(keep_output) {}
+
+uint64 ResultCache::content_key(const vector<uchar>& bytes)
+{
+	// FNV-1a over 8-byte words with a fold after each, then the tail
+	const uint64 prime = 0x100000001b3ULL;
+	uint64 h = 0xcbf29ce484222325ULL ^ bytes.size();
+	size_t i = 0;
+	for (; i + 8 <= bytes.size(); i += 8)
+	{
+		uint64 w;
+		memcpy(&w, &bytes[i], 8);
+		h = (h ^ w) * prime;
+		h ^= h >> 32;
+	}
+	for (; i < bytes.size(); ++i)
+		h = (h ^ bytes[i]) * prime;
+	return h;
+}
+
+uint64 ResultCache::perceptual_key(const Mat& image)
+{
+	Mat gray, thumb;
+	if (image.channels() == 4) cvtColor(image, gray, COLOR_BGRA2GRAY);
+	else if (image.channels() == 3) cvtColor(image, gray, COLOR_BGR2GRAY);
+	else gray = image;
+	resize(gray, thumb, Size(9, 8), 0, 0, INTER_AREA);
+	uint64 bits = 0;
+	for (int y = 0; y < 8; ++y)
+		for (int x = 0; x < 8; ++x)
+			bits = bits << 1 | (thumb.at<uchar>(y, x) > thumb.at<uchar>(y, x + 1));
+	// a crop of the same slide is a different picture
+	uint64 aspect = (uint64)cvRound(64.0 * image.cols / max(1, image.rows));
+	return bits ^ aspect * 0x9e3779b97f4a7c15ULL;
+}
+
+bool ResultCache::found(list<Item>::iterator it, Entry& entry)
+{
+	items.splice(items.begin(), items, it);
+	entry = it->entry;
+	return true;
+}
+
+bool ResultCache::find(uint64 key, Entry& entry)
+{
+	lock_guard<mutex> guard(lock);
+	auto it = by_content.find(key);
+	if (it == by_content.end()) return false;
+	++stats.hits;
+	return found(it->second, entry);
+}
+
+bool ResultCache::find_perceptual(uint64 key, Entry& entry)
+{
+	lock_guard<mutex> guard(lock);
+	auto it = by_perceptual.find(key);
+	if (it == by_perceptual.end())
+	{
+		++stats.misses;
+		return false;
+	}
+	++stats.perceptual_hits;
+	return found(by_content[it->second], entry);
+}
+
+void ResultCache::insert(uint64 key, uint64 perceptual, const Entry& entry)
+{
+	lock_guard<mutex> guard(lock);
+	auto it = by_content.find(key);
+	if (it != by_content.end())
+	{
+		used -= bytes_of(it->second->entry);
+		items.erase(it->second);
+	}
+	items.push_front(Item{ key, perceptual, entry });
+	if (!keep) items.front().entry.output.clear();
+	by_content[key] = items.begin();
+	by_perceptual[perceptual] = key;
+	used += bytes_of(items.front().entry);
+
+	while (used > max_bytes && items.size() > 1)
+	{
+		const Item& last = items.back();
+		auto p = by_perceptual.find(last.perceptual);
+		if (p != by_perceptual.end() && p->second == last.key) by_perceptual.erase(p);
+		by_content.erase(last.key);
+		used -= bytes_of(last.entry);
+		items.pop_back();
+		++stats.evictions;
+	}
+}
+
+ResultCache::Counters ResultCache::counters() const
+{
+	lock_guard<mutex> guard(lock);
+	return stats;
+}
+
+// rough footprint, list node and both index entries included
+size_t ResultCache::bytes_of(const Entry& entry)
+{
+	return sizeof(Item) + 96 + entry.points.size() * sizeof(Point2f) + entry.output.size();
+}
+
+// Panoramas and long screenshots: cut finds the band along the long side
+// that holds the content, from the gradient profile of a thumbnail, and
+// returns a view of it so detection skips the empty rest; deal maps points
+// found in the band back to the whole image.
 class Extreme_Img_Helper
 {
 public:
 	Mat& cut(Mat&);
-	vector<Point2f> deal(const vector<Point2f>& line_nodes, const vector<Point2f>& corner_nodes);
+	vector<Point2f> deal(const vector<Point2f>& points) const;
+	void release() { band.release(); }
+
+	double min_aspect = 2.5;   // long side / short side that counts as extreme
+	int thumb_side = 512;
+	double keep_ratio = 0.8;   // don't bother cropping a band longer than this
 private:
-	enum class state;
+	enum class state { Normal, Wide, Tall };
+	state st = state::Normal;
+	Rect roi;
+	Mat band;
 };
 
-unordered_map<string, Mat> PPTRestore::tempImg;
+Mat& Extreme_Img_Helper::cut(Mat& img)
+{
+	st = state::Normal;
+	roi = Rect(0, 0, img.cols, img.rows);
+	band = img;
+	if (img.empty() || max(img.cols, img.rows) < min_aspect * min(img.cols, img.rows)) return band;
+	st = img.cols > img.rows ? state::Wide : state::Tall;
+
+	Mat gray, thumb, gradient, profile;
+	if (img.channels() != 1) cvtColor(img, gray, COLOR_BGR2GRAY);
+	else gray = img;
+	// the short side would round to 0 past about 2 * thumb_side:1
+	double scale = (double)thumb_side / max(img.cols, img.rows);
+	Size thumb_size(max(1, cvRound(img.cols * scale)), max(1, cvRound(img.rows * scale)));
+	resize(gray, thumb, thumb_size, 0, 0, INTER_AREA);
+	morphologyEx(thumb, gradient, MORPH_GRADIENT, Mat());
+	reduce(gradient, profile, st == state::Wide ? 0 : 1, REDUCE_AVG, CV_32F);
+
+	// longest run above half the mean, bridging gaps of 2% of the length
+	const float* v = profile.ptr<float>();
+	const int n = (int)profile.total();
+	const float threshold = 0.5f * (float)mean(profile)[0];
+	const int max_gap = max(1, n / 50);
+	int best_first = 0, best_last = -1, first = -1, last = -1, gap = 0;
+	for (int i = 0; i <= n; ++i)
+	{
+		if (i < n && v[i] > threshold)
+		{
+			if (first < 0) first = i;
+			last = i;
+			gap = 0;
+		}
+		else if (first >= 0 && (i == n || ++gap > max_gap))
+		{
+			if (last - first > best_last - best_first) best_first = first, best_last = last;
+			first = -1;
+		}
+	}
+	if (best_last < 0) return band;
+
+	const int length = st == state::Wide ? img.cols : img.rows;
+	const int pad = n / 20;
+	int lo = max(0, best_first - pad) * length / n;
+	int hi = min(n, best_last + 1 + pad) * length / n;
+	if (hi - lo > keep_ratio * length) return band;
+
+	roi = st == state::Wide ? Rect(lo, 0, hi - lo, img.rows) : Rect(0, lo, img.cols, hi - lo);
+	band = img(roi);
+	return band;
+}
+
+vector<Point2f> Extreme_Img_Helper::deal(const vector<Point2f>& points) const
+{
+	vector<Point2f> res;
+	for (auto p : points)
+		res.emplace_back(p.x + roi.x, p.y + roi.y);
+	return res;
+}
+
+thread_local unordered_map<string, Mat> PPTRestore::tempImg;
+
+// Debug holds no state, every object shares this one
+static Debug debug_output;
 
 struct PPTRestore::Ximpl
 {
 	Mat srcImage;
 	Mat afterCanny;
+	Mat edge_map; // Canny edges of the gray frame, kept for quad_confidence
+	Mat grayImage;
 	vector<Point2f> hull_points;
-
+	vector<Point2f> quad_points;
+	RotatedRect center_rect;
+
+	bool contour_fast_path = true;
+	double fast_path_max_cosine = 0.5;
+	double fast_path_min_area_ratio = 0.2;
+	double screen_min_area_ratio = 0.03;
+	double min_confidence = 0.3;
+	PPTRestore::EnhanceMode enhance_mode = PPTRestore::EnhanceMode::Sharpen;
+	double unsharp_sigma = 3;
+	double unsharp_amount = 1.5;
+	double clahe_clip_limit = 2;
+	int background_scale = 4;
+	PPTRestore::OutputFormat output_format = PPTRestore::OutputFormat::Color;
+	int tile_rows = 256;
+	int mapped_detect_side = 2048;
+	bool hough_roi = true;
+	double hough_band_ratio = 0.1;
+	int hough_band_min = 20;
+	bool corner_refine = true;
+	bool extreme_crop = true;
+	double corner_window_ratio = 0.02;
+	int corner_window_min = 8;
+	double corner_min_response = 0.01;
+
+	Mat camera_matrix, dist_coeffs;
+	shared_ptr<ResultCache> cache;
+	shared_ptr<DetectionLog> log;
+	double frame_time = -1; // timestamp of the frame being detected, for the log
+	double slide_change_threshold = 0.3; // mean difference of normalised signatures
+	int slide_settle_frames = 2;
+	Mat slide_signature, pending_signature;
+	int slide_count = 0, pending_frames = 0;
+
+	vector<Point2f> fixed_points;
+	Size fixed_frame_size;
+	Mat fixed_map1, fixed_map2;
+	int substituted_corners = 0;
+	int64 deadline = 0; // getTickCount() value, 0 when detect has no budget
+	const atomic<bool>* cancel = nullptr;
+	bool truncated = false;
+	PPTRestore::Statistics stats;
+
+	bool out_of_time();
 	Mat preprocess_image(Mat&);
-	vector<Point2f> corner_dectection(Mat&);
+	Mat frame_edges(Mat&);
+	bool accept_contour_quad(const vector<Point>& poly);
+	int refine_corners(vector<Point2f>& quad);
 	vector<Vec4f> edge_detection(Mat&);
+	vector<Rect> hough_bands(Size size) const;
 
-	map<float, Vec4f> find_cross_points_by_edges(const vector<Vec4f>& lines);
-	vector<Point2f> edge_corner_candidates(const map<float, Vec4f>&, const vector<Point2f>&);
-	vector<Point2f> cal_final_points(const vector<Point2f>& line_nodes, const vector<Point2f>& corner_nodes);
 	vector<vector<Point2f>> divide_points_into_4_parts(const vector<Point2f>& nodes);
-	Point2f& find_closest_points(const vector<Point2f>& line_nodes, const vector<Point2f>& corner_nodes);
 	vector<Point2f> cal_points_with_lines(const vector<Vec4f>&);
-	Point2f line_intersection(const Point2f& o1, const Point2f& p1, const Point2f& o2, const Point2f& p2);
-	void test(Mat);
+	double quad_confidence(const vector<Point2f>& quad, double full_area_ratio = 0);
+	vector<vector<Point2f>> screen_quads();
+	Mat homography_for(const vector<Point2f>&, Size&);
+	Mat inverse_homography_for(const vector<Point2f>&, Size&);
+	void fill_maps(const Mat& inv, Size size, int first, int last, Mat& map_x, Mat& map_y) const;
 	Mat perspective_transformation(const vector<Point2f>&, Mat&);
+	void to_output_channels(Mat& image) const;
+	void warp_tiles(const Mat& src, const Mat& inv, Mat& dst, bool rgb = false);
+	void build_remap(const vector<Point2f>& points, Size frame_size);
 	Mat image_enhance(Mat&);
-	Debug* debug;
-	Extreme_Img_Helper* helper;
+	Mat enhance_output(Mat&);
+	int enhance_margin() const;
+	uint64 settings_key(bool output) const;
+	Debug* debug = &debug_output;
+	Overlay overlay;
+	Extreme_Img_Helper helper;
 };
 
 PPTRestore::PPTRestore() : pImpl(new Ximpl()) {}
 
 PPTRestore::PPTRestore(const PPTRestore& other) : pImpl(new Ximpl(*other.pImpl)) {}
 
+PPTRestore::PPTRestore(PPTRestore&& other) : pImpl(other.pImpl)
+{
+	other.pImpl = nullptr;
+}
+
 PPTRestore& PPTRestore::operator=(PPTRestore other)
 {
 	std::swap(other.pImpl, this->pImpl);
@@ -118,6 +642,7 @@ PPTRestore::~PPTRestore()
 
 pair<double, double> autoCanny(Mat Input)
 {
+	if (!Input.isContinuous()) Input = Input.clone(); // ROIs can't be reshaped in place
 	Input = Input.reshape(0, 1); // spread Input Mat to single row
 	vector<double> vecFromMat;
 	Input.copyTo(vecFromMat); // Copy Input Mat to vector vecFromMat
@@ -129,6 +654,24 @@ pair<double, double> autoCanny(Mat Input)
 	return{ lower, upper };
 }
 
+// gray, BGR and BGRA, the 8-bit layouts the pipeline meets; dst keeps its
+// buffer when it already has the right size and type
+static void convert_channels(const Mat& src, Mat& dst, int channels)
+{
+	int code = -1;
+	switch (src.channels() * 10 + channels)
+	{
+	case 13: code = COLOR_GRAY2BGR; break;
+	case 14: code = COLOR_GRAY2BGRA; break;
+	case 31: code = COLOR_BGR2GRAY; break;
+	case 34: code = COLOR_BGR2BGRA; break;
+	case 41: code = COLOR_BGRA2GRAY; break;
+	case 43: code = COLOR_BGRA2BGR; break;
+	}
+	if (code < 0) src.copyTo(dst);
+	else cvtColor(src, dst, code);
+}
+
 double angle(Point pt1, Point pt2, Point pt0)
 {
 	double dx1 = pt1.x - pt0.x;
@@ -138,70 +681,89 @@ double angle(Point pt1, Point pt2, Point pt0)
 	return (dx1*dx2 + dy1*dy2) / sqrt((dx1*dx1 + dy1*dy1)*(dx2*dx2 + dy2*dy2) + 1e-10);
 }
 
-Mat PPTRestore::Ximpl::preprocess_image(Mat& img)
+// true once the detect budget is spent or the caller cancelled, and from
+// then on for this frame
+bool PPTRestore::Ximpl::out_of_time()
 {
+	if (cancel && !truncated)
+		truncated = cancel->load();
+	if (deadline && !truncated)
+		truncated = getTickCount() >= deadline;
+	return truncated;
+}
 
+// gray and Canny edges of the frame itself, quad_confidence scores against them
+Mat PPTRestore::Ximpl::frame_edges(Mat& img)
+{
 	Mat gray, edges;
-	cvtColor(img, gray, COLOR_BGR2GRAY);
+	if (img.channels() == 1) gray = img;
+	else cvtColor(img, gray, COLOR_BGR2GRAY);
+	grayImage = gray;
 	pair<double, double> p = autoCanny(gray);
 	double lower = p.first, upper = p.second;
-	cout << lower << " " << upper << endl;
 
 	Canny(gray, edges, lower, upper);
+	edge_map = edges;
+	return edges;
+}
+
+Mat PPTRestore::Ximpl::preprocess_image(Mat& img)
+{
+	hull_points.clear();
+	quad_points.clear();
+	center_rect = RotatedRect();
+
+	Mat edges = frame_edges(img), gray = grayImage;
+	afterCanny = edges;
 
 	vector<vector<Point>> contours;
 	findContours(edges.clone(), contours, RETR_EXTERNAL, CHAIN_APPROX_NONE);
 
-	if (contours.empty()) return img;
+	if (contours.empty()) return gray;
 
 	vector<vector<Point>> biggest_contours;
-	sort(contours.begin(), contours.end(), [](vector<Point> c1, vector<Point> c2) {return c1.size() > c2.size(); });
+	// only the two longest are needed in order, a full sort of thousands of contours is not
+	partial_sort(contours.begin(), contours.begin() + min<size_t>(2, contours.size()), contours.end(),
+		[](const vector<Point>& c1, const vector<Point>& c2) {return c1.size() > c2.size(); });
 
 	if (contours.size() >= 1) biggest_contours.emplace_back(contours[0]);
 	if (contours.size() >= 2) biggest_contours.emplace_back(contours[1]);
-	contours.erase(remove_if(contours.begin(), contours.end(), [](vector<Point> p) {return p.size() < 1000; }), contours.end());
+	contours.erase(remove_if(contours.begin(), contours.end(), [](const vector<Point>& p) {return p.size() < 1000; }), contours.end());
 
 
-	Mat tmp = img.clone();
-	for (int i = 0; i < img.rows; ++i)
-	{
-		for (int j = 0; j < img.cols; ++j)
-		{
-			tmp.at<Vec3b>(i, j)[0] = 255;
-			tmp.at<Vec3b>(i, j)[1] = 255;
-			tmp.at<Vec3b>(i, j)[2] = 255;
-		}
-	}
+	// edge_detection only looks for the dark contour, one channel is enough
+	Mat tmp(img.size(), CV_8UC1, Scalar(255));
 
+	// out of time, the largest contour among those seen so far is used
 	vector<vector<Point>> polyContours(contours.size());
 	int maxArea = 0;
+	double max_area = -1;
 	for (int index = 0; index < contours.size(); index++) {
-		if (contourArea(contours[index]) > contourArea(contours[maxArea]))
+		if (index > 0 && out_of_time()) break;
+		double area = contourArea(contours[index]);
+		if (area > max_area)
+		{
+			max_area = area;
 			maxArea = index;
+		}
 		approxPolyDP(contours[index], polyContours[index], 10, true);
 	}
 
+	// a clean four-vertex approximation is good enough, the Hough stage is not needed
+	if (contour_fast_path && !polyContours.empty() && accept_contour_quad(polyContours[maxArea]))
+		return tmp;
+
 	vector<RotatedRect> minRect(biggest_contours.size());
 	for (int i = 0; i < biggest_contours.size(); i++)
 		minRect[i] = minAreaRect(Mat(biggest_contours[i]));
-	Mat drawing = Mat::zeros(tmp.size(), CV_8UC3);
-	for (int i = 0; i< biggest_contours.size(); i++)
+	for (int i = 0; i < biggest_contours.size() && overlay.enabled; i++)
 	{
-		Scalar color = Scalar(0,255,0);
-		drawContours(drawing, biggest_contours, i, color, 1, 8, vector<Vec4i>(), 0, Point());
 		Point2f rect_points[4]; minRect[i].points(rect_points);
-		for (int j = 0; j < 4; j++)
-			line(drawing, rect_points[j], rect_points[(j + 1) % 4], color, 1, 8);
+		overlay.contour("contours", biggest_contours[i], Scalar(0, 255, 0));
+		overlay.contour("contours", vector<Point>(rect_points, rect_points + 4), Scalar(0, 255, 0));
+		overlay.points("contours", { minRect[i].center }, Scalar(255, 0, 0));
 	}
 
-	for (int i = 0; i< biggest_contours.size(); i++)
-	{
-		Scalar color = Scalar(255, 0, 0);
-		drawContours(drawing, biggest_contours, -1, Scalar(255), 2);
-		circle(drawing, minRect[i].center, 4, color, -1, 8, 0);
-	}
-	imshow("Contours", drawing);
-
 	unordered_map<string, int> table;
 	for (int i = 0; i < biggest_contours.size(); ++i)
 		table[to_string(int(minRect[i].center.x)) + to_string(int(minRect[i].center.y))] = i;
@@ -210,36 +772,28 @@ Mat PPTRestore::Ximpl::preprocess_image(Mat& img)
 			abs(r2.center.x - srcImage.cols / 2) + abs(r2.center.y - srcImage.rows / 2);
 	});
 	auto centerRect = minRect[0];
+	center_rect = centerRect;
 	vector<vector<Point>> centerRectContours;
 	centerRectContours.emplace_back(biggest_contours[table[to_string(int(centerRect.center.x)) + to_string(int(centerRect.center.y))]]);
 	
-	Mat polyPic = Mat::zeros(img.size(), CV_8UC3);
-	drawContours(polyPic, polyContours, maxArea, Scalar(0, 0, 255/*rand() & 255, rand() & 255, rand() & 255*/), 2);
-
-	vector<int>  hull;
-	convexHull(polyContours[maxArea], hull, false);    //检测该轮廓的凸包
+	if (!polyContours.empty())
+	{
+		vector<int>  hull;
+		convexHull(polyContours[maxArea], hull, false);    //检测该轮廓的凸包
 
-	for (int i = 0; i < hull.size(); ++i) {
-		circle(polyPic, polyContours[maxArea][i], 10, Scalar(rand() & 255, rand() & 255, rand() & 255), 3);
-		hull_points.emplace_back(polyContours[maxArea][i]);
+		for (int i = 0; i < hull.size(); ++i)
+			hull_points.emplace_back(polyContours[maxArea][i]);
+		overlay.contour("hull", polyContours[maxArea], Scalar(0, 0, 255), 2);
+		overlay.points("hull", hull_points, Scalar(0, 255, 255), 10);
 	}
 
-	addWeighted(polyPic, 0.5, img, 0.5, 0, img);
-
-	imshow("beforetmp", tmp);
-
 	for (int i = 0; i < centerRectContours.size(); ++i)
 	{
 		for (int j = 0; j < centerRectContours[i].size(); ++j)
-		{
-			tmp.at<Vec3b>(centerRectContours[i][j].y, centerRectContours[i][j].x)[0] = 0;
-			tmp.at<Vec3b>(centerRectContours[i][j].y, centerRectContours[i][j].x)[1] = 0;
-			tmp.at<Vec3b>(centerRectContours[i][j].y, centerRectContours[i][j].x)[2] = 0;
-		}
+			tmp.at<uchar>(centerRectContours[i][j].y, centerRectContours[i][j].x) = 0;
+		overlay.contour("center", centerRectContours[i], Scalar(0, 0, 0));
 	}
 
-	imshow("tmp", tmp);
-
 	//Mat src_gray, after_gaus, res;
 	//string source_window = "pre_process";
 
@@ -253,62 +807,103 @@ Mat PPTRestore::Ximpl::preprocess_image(Mat& img)
 	return tmp;
 }
 
-vector<Point2f> PPTRestore::Ximpl::corner_dectection(Mat& src)
+// left_top, right_top, left_down, right_down, the order perspective_transformation expects
+static vector<Point2f> corner_order(const vector<Point2f>& pts)
 {
-	vector<Point2f> corners;
-	float qualityLevel = 0.01;
-	float minDistance = 10;
-	int blockSize = 3;
-	bool useHarrisDetector = false;
-	float k = 0.04;
+	auto by_sum = [](Point2f p1, Point2f p2) {return p1.x + p1.y < p2.x + p2.y; };
+	auto by_diff = [](Point2f p1, Point2f p2) {return p1.x - p1.y < p2.x - p2.y; };
+	return{ *min_element(pts.begin(), pts.end(), by_sum), *max_element(pts.begin(), pts.end(), by_diff),
+		*min_element(pts.begin(), pts.end(), by_diff), *max_element(pts.begin(), pts.end(), by_sum) };
+}
 
-	int maxCorners = 23;
-	int maxTrackbar = 100;
-	RNG rng(12345);
-	string source_window = "corner";
-	goodFeaturesToTrack(src, corners, maxCorners, qualityLevel, minDistance, Mat(), blockSize, useHarrisDetector, k);
+bool PPTRestore::Ximpl::accept_contour_quad(const vector<Point>& poly)
+{
+	if (poly.size() != 4 || !isContourConvex(poly)) return false;
+	if (contourArea(poly) < fast_path_min_area_ratio * srcImage.rows * srcImage.cols) return false;
 
-	Mat tmp = src.clone();
-	int r = 4;
-	for (int i = 0; i < corners.size(); i++)
-	{
-		circle(tmp, corners[i], r, Scalar(255, 0, 0), -1, 8, 0);
-	}
+	double max_cosine = 0;
+	for (int i = 0; i < 4; ++i)
+		max_cosine = max(max_cosine, fabs(angle(poly[(i + 1) % 4], poly[(i + 3) % 4], poly[i])));
+	if (max_cosine > fast_path_max_cosine) return false;
 
-	debug->show_img(source_window, tmp);
-	PPTRestore::tempImg["corner"] = tmp;
-	return corners;
+	quad_points = corner_order(vector<Point2f>(poly.begin(), poly.end()));
+	return true;
 }
 
-void PPTRestore::Ximpl::test(Mat src)
+// Every convex, roughly rectangular quad in the edge map preprocess_image
+// left behind that covers at least screen_min_area_ratio of the frame. Larger
+// ones first; an outline mostly inside a larger one (the inner edge of a
+// bezel, a window on the slide) is dropped.
+vector<vector<Point2f>> PPTRestore::Ximpl::screen_quads()
 {
-	Mat dst = afterCanny;
-	const float approachMaxThreshold = 20;
+	Mat closed;
+	dilate(afterCanny, closed, Mat());
 	vector<vector<Point>> contours;
-	findContours(dst, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
-	Mat result = Mat::zeros(dst.size(), CV_8UC1);
-	if (!contours.empty())
+	findContours(closed, contours, RETR_LIST, CHAIN_APPROX_SIMPLE);
+
+	const double image_area = (double)afterCanny.rows * afterCanny.cols;
+	vector<pair<double, vector<Point>>> candidates;
+	for (const auto& c : contours)
 	{
-		//result:存放轮廓，contours：找到的轮廓，-1：将所有轮廓画出，Scalar(255)：白色画笔，2：为画笔粗细
-		drawContours(result, contours, -1, Scalar(255), 2);
-		imshow("处理图", result);
+		if (contourArea(c) < screen_min_area_ratio * image_area) continue;
+		vector<Point> poly;
+		approxPolyDP(c, poly, 0.02 * arcLength(c, true), true);
+		if (poly.size() != 4 || !isContourConvex(poly)) continue;
+		double max_cosine = 0;
+		for (int i = 0; i < 4; ++i)
+			max_cosine = max(max_cosine, fabs(angle(poly[(i + 1) % 4], poly[(i + 3) % 4], poly[i])));
+		if (max_cosine > fast_path_max_cosine) continue;
+		candidates.emplace_back(contourArea(poly), poly);
 	}
+	sort(candidates.begin(), candidates.end(), [](const pair<double, vector<Point>>& c1, const pair<double, vector<Point>>& c2) {
+		return c1.first > c2.first; });
 
-	cout << contours.size() << endl;
-	cout << contours[0].size() << endl;
-
+	vector<vector<Point2f>> quads;
+	vector<Rect> kept;
+	for (const auto& c : candidates)
+	{
+		Rect r = boundingRect(c.second);
+		if (any_of(kept.begin(), kept.end(), [&](const Rect& k) { return (r & k).area() > 0.5 * r.area(); }))
+			continue;
+		kept.push_back(r);
+		quads.push_back(corner_order(vector<Point2f>(c.second.begin(), c.second.end())));
+		overlay.contour("screens", c.second, Scalar(0, 255, 255), 2);
+	}
+	return quads;
 }
 
-bool is_similar_line(const Vec4i& _l1, const Vec4i& _l2)
+// Checks each corner against the corner response in a small window around
+// it and moves it to the strongest one, instead of running
+// goodFeaturesToTrack over the frame and throwing most of the result away.
+// Corners on the image border are substitutes and are left alone.
+int PPTRestore::Ximpl::refine_corners(vector<Point2f>& quad)
 {
-	Vec4i l1(_l1), l2(_l2);
+	const int r = max(corner_window_min, cvRound(corner_window_ratio * min(grayImage.cols, grayImage.rows)));
+	Rect image_rect(0, 0, grayImage.cols, grayImage.rows);
+	int verified = 0;
+	for (auto& p : quad)
+	{
+		if (p.x <= 0 || p.y <= 0 || p.x >= grayImage.cols || p.y >= grayImage.rows) continue;
+		Rect window = Rect(cvRound(p.x) - r, cvRound(p.y) - r, 2 * r + 1, 2 * r + 1) & image_rect;
+		Mat response;
+		cornerMinEigenVal(grayImage(window), response, 3, 3);
+		double max_response = 0;
+		Point peak;
+		minMaxLoc(response, 0, &max_response, 0, &peak);
+		if (max_response < corner_min_response) continue;
+		p = Point2f((float)(window.x + peak.x), (float)(window.y + peak.y));
+		++verified;
+	}
+	overlay.points("corner_windows", quad, Scalar(255, 0, 0));
+	return verified;
+}
 
+bool is_similar_line(const Vec4f& l1, const Vec4f& l2)
+{
 	float length1 = sqrtf((l1[2] - l1[0])*(l1[2] - l1[0]) + (l1[3] - l1[1])*(l1[3] - l1[1]));
 	float length2 = sqrtf((l2[2] - l2[0])*(l2[2] - l2[0]) + (l2[3] - l2[1])*(l2[3] - l2[1]));
 
-	float product = (l1[2] - l1[0])*(l2[2] - l2[0]) + (l1[3] - l1[1])*(l2[3] - l2[1]);
-
-	if (fabs(product / (length1 * length2)) < cos(CV_PI / 30))
+	if (LineSet::cos_angle(l1, l2) < cos(CV_PI / 30))
 		return false;
 
 	float mx1 = (l1[0] + l1[2]) * 0.5f;
@@ -327,43 +922,43 @@ bool is_similar_line(const Vec4i& _l1, const Vec4i& _l2)
 
 vector<Vec4f> PPTRestore::Ximpl::edge_detection(Mat& src)
 {
-	// to do
-	float alpha = 2.0; /*< Simple contrast control */
-	int beta = 1;       /*< Simple brightness control */
-	Mat dst = src;
-	Mat new_image = Mat::zeros(dst.size(), dst.type());
-	for (int y = 0; y < dst.rows; y++) {
-		for (int x = 0; x < dst.cols; x++) {
-			for (int c = 0; c < dst.channels(); c++) {
-				new_image.at<Vec3b>(y, x)[c] =
-					saturate_cast<uchar>(alpha*dst.at<Vec3b>(y, x)[c] + beta);
-			}
-		}
-	}
+	// src is the single channel output of preprocess_image
  	vector<Vec4f> lines;
-	src = dst;
-	Mat gray;
-	cvtColor(src, gray, COLOR_BGR2GRAY);
-	pair<double, double> p = autoCanny(gray);
-	double lower = p.first, upper = p.second;
-
-	Mat mid, edgeDetect;
-	Canny(src, mid, lower, upper, 3);
-	imshow("bbbbbb", mid);
-	//threshold(mid, mid, 128, 255, THRESH_BINARY);
-	cvtColor(mid, edgeDetect, CV_GRAY2RGB);
+	Mat mid = Mat::zeros(src.size(), CV_8UC1);
 
 	int min_line_length = 50;
 	int max_line_gap = 100;
-	HoughLinesP(mid,
-		lines,
-		1,
-		CV_PI / 180,
-		10,
-		min_line_length,
-		max_line_gap
-	);
-	cout << "lines.size()" << lines.size() << endl;
+	auto search = [&](const vector<Rect>& bands) {
+		for (auto band : bands)
+		{
+			if (out_of_time()) break;
+			Mat band_src = src(band), band_edges = mid(band);
+			pair<double, double> p = autoCanny(band_src);
+			double lower = p.first, upper = p.second;
+			Canny(band_src, band_edges, lower, upper, 3);
+			//threshold(mid, mid, 128, 255, THRESH_BINARY);
+
+			vector<Vec4f> band_lines;
+			HoughLinesP(band_edges,
+				band_lines,
+				1,
+				CV_PI / 180,
+				10,
+				min_line_length,
+				max_line_gap
+			);
+			for (auto l : band_lines)
+				lines.emplace_back(l + Vec4f(band.x, band.y, band.x, band.y));
+		}
+	};
+
+	// only look along the sides of the contour preprocess_image picked, fall
+	// back to the whole frame when that finds nothing
+	Rect image_rect(0, 0, src.cols, src.rows);
+	auto bands = hough_bands(src.size());
+	search(bands);
+	if (lines.empty() && !(bands.size() == 1 && bands[0] == image_rect) && !out_of_time())
+		search({ image_rect });
 	
 	afterCanny = mid;
 
@@ -378,13 +973,34 @@ vector<Vec4f> PPTRestore::Ximpl::edge_detection(Mat& src)
 	lines.erase(remove_if(lines.begin(), lines.end(), IsCloseToEdge()), lines.end());
 	if (lines.empty()) return{};
 
-	std::vector<int> labels;
-	int numberOfLines = cv::partition(lines, labels, is_similar_line);
+	// the same classes cv::partition finds, but longest lines first and with a
+	// deadline check per line: when time runs out the shorter, unmerged lines
+	// are dropped and the classes found so far are kept
+	auto length2 = [](const Vec4f& l) { return (l[2] - l[0]) * (l[2] - l[0]) + (l[3] - l[1]) * (l[3] - l[1]); };
+	stable_sort(lines.begin(), lines.end(), [&](const Vec4f& l1, const Vec4f& l2) { return length2(l1) > length2(l2); });
+	vector<int> parent(lines.size());
+	auto root = [&](int i) {
+		while (parent[i] != i) i = parent[i] = parent[parent[i]];
+		return i;
+	};
+	int merged = 0;
+	for (; merged < (int)lines.size() && !out_of_time(); ++merged)
+	{
+		parent[merged] = merged;
+		for (int j = 0; j < merged; ++j)
+			if (is_similar_line(lines[merged], lines[j]))
+			{
+				int r1 = root(merged), r2 = root(j);
+				parent[max(r1, r2)] = min(r1, r2); // the root stays the longest line
+			}
+	}
+	lines.resize(merged);
+	if (lines.empty()) return{};
 
+	// one representative per class, its longest line
 	vector<Vec4f> final_lines;
-	int max_size = *max_element(labels.begin(), labels.end());
-	for (int i = 0; i < max_size + 1; ++i)
-		final_lines.emplace_back(lines[find(labels.begin(), labels.end(), i) - labels.begin()]);
+	for (int i = 0; i < merged; ++i)
+		if (root(i) == i) final_lines.emplace_back(lines[i]);
 
 	sort(final_lines.begin(), final_lines.end(), [](Vec4f v1, Vec4f v2) {return
 		pow(v1[0] - v1[2], 2) + pow(v1[1] - v1[3], 2) < pow(v2[0] - v2[2], 2) + pow(v2[1] - v2[3], 2) ; });
@@ -396,63 +1012,47 @@ vector<Vec4f> PPTRestore::Ximpl::edge_detection(Mat& src)
 		< 0.2 * (pow(v2[0] - v2[2], 2) + pow(v2[1] - v2[3], 2)); 
 	}), final_lines.end());
 
-
-	for (size_t i = 0; i < final_lines.size(); i++)
-	{
-		Vec4i l = final_lines[i];
-		line(edgeDetect, Point(l[0], l[1]), Point(l[2], l[3]), Scalar(0, 0, 255), 1, CV_AA);
-	}
-
-	debug->show_img("【边缘提取效果图】", edgeDetect);
+	overlay.lines("lines", final_lines, Scalar(0, 0, 255));
 	return final_lines;
 }
 
 
-Point2f PPTRestore::Ximpl::line_intersection(const Point2f& o1, const Point2f& p1, const Point2f& o2, const Point2f& p2)
+// four thin strips around the sides of the centre contour's rotated rectangle,
+// or the whole frame if there is no such contour
+vector<Rect> PPTRestore::Ximpl::hough_bands(Size size) const
 {
-	Point2f x = o2 - o1;
-	Point2f d1 = p1 - o1;
-	Point2f d2 = p2 - o2;
-
-	float cross = d1.x*d2.y - d1.y*d2.x;
-	double t1 = (x.x * d2.y - x.y * d2.x) / cross;
-	return o1 + d1 * t1;
+	Rect image_rect(0, 0, size.width, size.height);
+	if (!hough_roi || center_rect.size.width <= 0 || center_rect.size.height <= 0)
+		return{ image_rect };
+
+	Point2f pts[4];
+	center_rect.points(pts);
+	int margin = max(hough_band_min, cvRound(hough_band_ratio * min(center_rect.size.width, center_rect.size.height)));
+	vector<Rect> bands;
+	for (int i = 0; i < 4; ++i)
+	{
+		Rect side = boundingRect(vector<Point2f>{ pts[i], pts[(i + 1) % 4] });
+		side = Rect(side.x - margin, side.y - margin, side.width + 2 * margin, side.height + 2 * margin) & image_rect;
+		if (side.area() > 0) bands.push_back(side);
+	}
+	return bands;
 }
 
 vector<Point2f> PPTRestore::Ximpl::cal_points_with_lines(const vector<Vec4f>& lines)
 {
-	cout << "size is : " << lines.size() << endl;
 	//left, right, up, down
-	vector<float> ratio;
-	vector<float> intersects;
-	for (int i = 0; i < lines.size(); ++i)
-	{
-		ratio.emplace_back((lines[i][3] - lines[i][1]) / (lines[i][2] - lines[i][0]));
-		intersects.emplace_back(lines[i][1] - ratio[i] * lines[i][0]);
-	}
-	
 	vector<Point2f> intersect_points;
 	const float height = srcImage.rows; // height
 	const float width = srcImage.cols; // width
 
 	Point2f center(width / 2, height / 2);
 
-	cout << height << endl;
-	cout << width << endl;
-
 	vector<Point2f> cross_points(hull_points);
-	int min_padding = 50;
-	for (int i = 0; i < lines.size(); ++i)
-	{
-		for (int j = i; j < lines.size(); ++j)
-		{
-			if (j == i) continue;
-			Point2f c = line_intersection(Point2f(lines[i][0], lines[i][1]), Point2f(lines[i][2], lines[i][3]),
-				Point2f(lines[j][0], lines[j][1]), Point2f(lines[j][2], lines[j][3]));
-			if (c.x < -min_padding || c.x > width + min_padding || c.y < -min_padding || c.y > height + min_padding) continue;
-			cross_points.emplace_back(c);
-		}
-	}
+	float min_padding = 50;
+	LineSet line_set(lines);
+	const int chunk = 64; // rows of the pairwise loop between deadline checks
+	for (int i = 0; i < (int)lines.size() && !out_of_time(); i += chunk)
+		line_set.intersect_all(Point2f(-min_padding, -min_padding), Point2f(width + min_padding, height + min_padding), cross_points, i, i + chunk);
 
 	// add all line's edge point into cross_points
 	for (auto line : lines)
@@ -461,14 +1061,7 @@ vector<Point2f> PPTRestore::Ximpl::cal_points_with_lines(const vector<Vec4f>& li
 		cross_points.emplace_back(Point2f(line[2], line[3]));
 	}
 
-
-	Mat t = srcImage.clone();
-	int r = 4;
-	for (int i = 0; i < cross_points.size(); i++)
-	{
-		circle(t, cross_points[i], r, Scalar(0, 255, 0), -1, 8, 0);
-	}
-	imshow("aaaaaaaaaaa", t);
+	overlay.points("cross_points", cross_points, Scalar(0, 255, 0));
 
 	vector<vector<Point2f>> _4_parts = divide_points_into_4_parts(cross_points);
 	vector<Point2f> a = _4_parts[0];
@@ -492,6 +1085,7 @@ vector<Point2f> PPTRestore::Ximpl::cal_points_with_lines(const vector<Vec4f>& li
 	return pow(center.y - p1.y, 2) + pow(center.x - p1.x, 2) < pow(center.y - p2.y, 2) + pow(center.x - p2.x, 2); });
 	sort(d.begin(), d.end(), [&](Point2f p1, Point2f p2) {
 	return pow(center.y - p1.y, 2) + pow(center.x - p1.x, 2) < pow(center.y - p2.y, 2) + pow(center.x - p2.x, 2); });
+	substituted_corners = a.empty() + b.empty() + c.empty() + d.empty();
 	intersect_points.emplace_back(a.empty() ? Point2f(0, 0) : a.back());
 	intersect_points.emplace_back(c.empty() ? Point2f(srcImage.cols, 0) : c.back());
 	intersect_points.emplace_back(b.empty() ? Point2f(0, srcImage.rows) : b.back());
@@ -500,144 +1094,64 @@ vector<Point2f> PPTRestore::Ximpl::cal_points_with_lines(const vector<Vec4f>& li
 }
 
 
-map<float, Vec4f> PPTRestore::Ximpl::find_cross_points_by_edges(const vector<Vec4f>& lines)
+// full_area_ratio: area that scores 1, fast_path_min_area_ratio when 0
+double PPTRestore::Ximpl::quad_confidence(const vector<Point2f>& quad, double full_area_ratio)
 {
-	Point2f left_top, right_top, left_down, right_down;
-	map<float, Vec4f> table_vec;
-	vector<float> ratios;
-	for (auto line : lines)
+	// walk the outline in order: left_top, right_top, right_down, left_down
+	vector<Point2f> outline = { quad[0], quad[1], quad[3], quad[2] };
+	if (!isContourConvex(outline)) return 0;
+
+	const double image_area = (double)srcImage.rows * srcImage.cols;
+	double area_ratio = contourArea(outline) / image_area;
+	double area_score = min(1.0, area_ratio / (full_area_ratio > 0 ? full_area_ratio : fast_path_min_area_ratio));
+
+	// fraction of samples along the sides that land within one pixel of a Canny
+	// edge of the frame itself; afterCanny holds the centre contour's edges by now,
+	// which the Hough lines were fitted to and would always agree
+	int samples = 0, supported = 0;
+	for (int i = 0; i < 4; ++i)
 	{
-		int start_x = line[0];
-		int start_y = line[1];
-		int end_x = line[2];
-		int end_y = line[3];
-		float ratio = (float)(end_y - start_y) / (float)(end_x - start_x);
-
-		table_vec[ratio] = line;
+		Point2f p1 = outline[i], p2 = outline[(i + 1) % 4];
+		int steps = min(64, max(1, (int)(norm(p2 - p1) / 4)));
+		for (int k = 0; k <= steps; ++k)
+		{
+			Point2f p = p1 + (p2 - p1) * ((double)k / steps);
+			int x = cvRound(p.x), y = cvRound(p.y);
+			if (x < 1 || y < 1 || x >= edge_map.cols - 1 || y >= edge_map.rows - 1) continue;
+			++samples;
+			bool hit = false;
+			for (int dy = -1; dy <= 1 && !hit; ++dy)
+				for (int dx = -1; dx <= 1 && !hit; ++dx)
+					hit = edge_map.at<uchar>(y + dy, x + dx) != 0;
+			supported += hit;
+		}
 	}
+	double edge_score = samples ? (double)supported / samples : 0;
 
-	return table_vec;
+	return edge_score * area_score * (4 - substituted_corners) / 4.0;
 }
 
-vector<Point2f> PPTRestore::Ximpl::edge_corner_candidates(const map<float, Vec4f>& ratio_2points, const vector<Point2f>& corners)
+vector<vector<Point2f>> PPTRestore::Ximpl::divide_points_into_4_parts(const vector<Point2f>& line_nodes)
 {
-	vector<float> intercepts;
-	vector<float> ratios;
-	vector<Point> points;
-	vector<Point2f> corner_nodes;
-
-	Types<float>::ascend_distance nodes_to_lines;
-	for (auto p : ratio_2points)
-	{
-		ratios.push_back(p.first);
-		intercepts.push_back((p.second)[1] - (p.first * (p.second)[0]));
-	}
-
-	for (int i = 0; i < corners.size(); ++i)
+	vector<Point2f> left_top_line_nodes, left_down_line_nodes, right_top_line_nodes, right_down_line_nodes;
+	vector<vector<Point2f>> res;
+	int height = this->srcImage.cols / 2, width = this->srcImage.rows / 2;
+	float p1 = 1, p2 = 1; //tiao can
+	for (auto node : line_nodes)
 	{
-		float min_dis = INT_MAX;
-		for (int j = 0; j < ratio_2points.size(); ++j)
+		if (node.x < height * p1)
 		{
-			float dis = (float)abs(ratios[j] * corners[i].x - corners[i].y + intercepts[j]) / (float)sqrt(pow(ratios[j], 2) + 1);
-			if (dis < min_dis)
-				min_dis = dis;
-		}
-		nodes_to_lines.push({ corners[i], min_dis });
-	}
-
-	int num = 100;
-
-	while (!nodes_to_lines.empty() && num > 0)
-	{
-		auto p = nodes_to_lines.top().first;
-		corner_nodes.emplace_back(Point2f(p.x, p.y));
-		nodes_to_lines.pop();
-		num--;
-	}
-
-	Mat to_show = srcImage;
-	Mat show_corner_Mat = to_show.clone();
-	RNG rng(12345);
-	int r = 4;
-	for (int i = 0; i < corner_nodes.size(); i++)
-	{
-		circle(show_corner_Mat, corners[i], r, Scalar(0, 255, 0), -1, 8, 0);
-	}
-	PPTRestore::tempImg["together"] = show_corner_Mat;
-	//transform the nodes in the ratio_2points int vector<Point2f>
-	vector<Point2f> line_nodes;
-	for (auto p : ratio_2points)
-	{
-		line_nodes.emplace_back(Point2f((float)p.second[0], (float)p.second[1]));
-		line_nodes.emplace_back(Point2f((float)p.second[2], (float)p.second[3]));
-	}
-
-
-	for (int i = 0; i < line_nodes.size(); i++)
-	{
-		circle(show_corner_Mat, line_nodes[i], r, Scalar(rng.uniform(0, 255), rng.uniform(0, 255),
-			rng.uniform(0, 255)), -1, 8, 0);
-	}
-	return cal_final_points(line_nodes, corner_nodes);
-}
-
-vector<Point2f> PPTRestore::Ximpl::cal_final_points(const vector<Point2f>& line_nodes, const vector<Point2f>& corner_nodes)
-{
-	vector<vector<Point2f>> line_temp = divide_points_into_4_parts(line_nodes);
-	vector<vector<Point2f>> corner_temp = divide_points_into_4_parts(corner_nodes);
-
-	vector<Point2f> left_top_line_nodes = line_temp[0], left_down_line_nodes = line_temp[1], right_top_line_nodes = line_temp[2], right_down_line_nodes = line_temp[3], res;
-	vector<Point2f> left_top_corner_nodes = corner_temp[0], left_down_corner_nodes = corner_temp[1], right_top_corner_nodes = corner_temp[2], right_down_corner_nodes = corner_temp[3];
-
-	res.emplace_back(find_closest_points(left_top_line_nodes, left_top_corner_nodes));
-	res.emplace_back(find_closest_points(right_top_line_nodes, right_top_corner_nodes));
-	res.emplace_back(find_closest_points(left_down_line_nodes, left_down_corner_nodes));
-	res.emplace_back(find_closest_points(right_down_line_nodes, right_down_corner_nodes));
-
-	return res;
-}
-
-Point2f& PPTRestore::Ximpl::find_closest_points(const vector<Point2f>& line_nodes, const vector<Point2f>& corner_nodes)
-{
-
-	if (line_nodes.size() == 1) return const_cast<Point2f&>(line_nodes[0]);
-	float min_dis = DBL_MAX;
-	int position = 0;
-	for (int i = 0; i < line_nodes.size(); ++i)
-	{
-		for (int j = 0; j < corner_nodes.size(); ++j)
-		{
-			if (pow(line_nodes[i].x - corner_nodes[j].x, 2) + pow(line_nodes[i].y - corner_nodes[j].y, 2) < min_dis)
-			{
-				min_dis = pow(line_nodes[i].x - corner_nodes[j].x, 2) + pow(line_nodes[i].y - corner_nodes[j].y, 2);
-				position = i;
-			}
-		}
-	}
-	return const_cast<Point2f&>(line_nodes[position]);
-}
-
-vector<vector<Point2f>> PPTRestore::Ximpl::divide_points_into_4_parts(const vector<Point2f>& line_nodes)
-{
-	vector<Point2f> left_top_line_nodes, left_down_line_nodes, right_top_line_nodes, right_down_line_nodes;
-	vector<vector<Point2f>> res;
-	int height = this->srcImage.cols / 2, width = this->srcImage.rows / 2;
-	float p1 = 1, p2 = 1; //tiao can
-	for (auto node : line_nodes)
-	{
-		if (node.x < height * p1)
-		{
-			if (node.y < width * p1)
-				left_top_line_nodes.emplace_back(node);
-			if (node.y > width * p2)
-				left_down_line_nodes.emplace_back(node);
-		}
-		if (node.x > height * p2)
-		{
-			if (node.y < width * p1)
-				right_top_line_nodes.emplace_back(node);
-			if (node.y > width * p2)
-				right_down_line_nodes.emplace_back(node);
+			if (node.y < width * p1)
+				left_top_line_nodes.emplace_back(node);
+			if (node.y > width * p2)
+				left_down_line_nodes.emplace_back(node);
+		}
+		if (node.x > height * p2)
+		{
+			if (node.y < width * p1)
+				right_top_line_nodes.emplace_back(node);
+			if (node.y > width * p2)
+				right_down_line_nodes.emplace_back(node);
 		}
 	}
 	res.emplace_back(left_top_line_nodes);
@@ -647,14 +1161,12 @@ vector<vector<Point2f>> PPTRestore::Ximpl::divide_points_into_4_parts(const vect
 	return res;
 }
 
-Mat PPTRestore::Ximpl::perspective_transformation(const vector<Point2f>& final_points, Mat& src)
+Mat PPTRestore::Ximpl::homography_for(const vector<Point2f>& final_points, Size& size)
 {
-	debug->print(final_points);
 	Point2f _srcTriangle[4];
 	Point2f _dstTriangle[4];
 	vector<Point2f>srcTriangle(_srcTriangle, _srcTriangle + 4);
 	vector<Point2f>dstTriangle(_dstTriangle, _dstTriangle + 4);
-	Mat after_transform;
 
 	const int leftTopX = final_points[0].x;
 	const int leftTopY = final_points[0].y;
@@ -670,8 +1182,7 @@ Mat PPTRestore::Ximpl::perspective_transformation(const vector<Point2f>& final_p
 
 	newWidth = sqrt((leftTopX - rightTopX) * (leftTopX - rightTopX) + (leftTopY - rightTopY) * (leftTopY - rightTopY));
 	newHeight = sqrt((leftTopX - leftDownX) * (leftTopX - leftDownX) + (leftTopY - leftDownY) * (leftTopY - leftDownY));
-
-	after_transform = Mat::zeros(newHeight, newWidth, src.type());
+	size = Size(newWidth, newHeight);
 
 	srcTriangle[0] = Point2f(leftTopX, leftTopY);
 	srcTriangle[1] = Point2f(rightTopX, rightTopY);
@@ -683,51 +1194,962 @@ Mat PPTRestore::Ximpl::perspective_transformation(const vector<Point2f>& final_p
 	dstTriangle[2] = Point2f(0, newHeight);
 	dstTriangle[3] = Point2f(newWidth, newHeight);
 
-
 	Mat m1 = Mat(srcTriangle);
 	Mat m2 = Mat(dstTriangle);
 	Mat status;
-	Mat h = findHomography(m1, m2, status, 0, 3);
-	perspectiveTransform(srcTriangle, dstTriangle, h);
-	warpPerspective(src, after_transform, h, after_transform.size());
+	return findHomography(m1, m2, status, 0, 3);
+}
+
+Mat PPTRestore::Ximpl::perspective_transformation(const vector<Point2f>& final_points, Mat& src)
+{
+	debug->print(final_points);
+	Size size;
+	if (!camera_matrix.empty())
+	{
+		// undistortion and rectification in one resampling pass over the raw frame
+		Mat inv = inverse_homography_for(final_points, size);
+		Mat map_x, map_y, after_transform;
+		fill_maps(inv, size, 0, size.height, map_x, map_y);
+		remap(src, after_transform, map_x, map_y, INTER_LINEAR);
+		to_output_channels(after_transform);
+		return after_transform;
+	}
+	Mat h = homography_for(final_points, size);
+
+	Mat warp_src = src;
+	if (output_format != PPTRestore::OutputFormat::Color && src.channels() != 1)
+	{
+		// convert only the pixels under the quad (plus the interpolation margin)
+		// and warp a single channel
+		Rect image_rect(0, 0, src.cols, src.rows);
+		Rect roi = boundingRect(final_points);
+		roi = Rect(roi.x - 2, roi.y - 2, roi.width + 4, roi.height + 4) & image_rect;
+		if (roi.area() == 0) roi = image_rect;
+		convert_channels(src(roi), warp_src, 1);
+		Mat shift = (Mat_<double>(3, 3) << 1, 0, roi.x, 0, 1, roi.y, 0, 0, 1);
+		h = h * shift;
+	}
+
+	Mat after_transform = Mat::zeros(size, warp_src.type());
+	warpPerspective(warp_src, after_transform, h, after_transform.size());
+	to_output_channels(after_transform);
 	debug->show_img(WINDOW_NAME2, after_transform);
 	return after_transform;
 }
 
+// what enhancement works on, as get_image(ImageView) picks it: gray for Gray
+// and Binary, BGR or gray for Color; BGRA loses its alpha
+void PPTRestore::Ximpl::to_output_channels(Mat& image) const
+{
+	int channels = output_format == PPTRestore::OutputFormat::Color ? min(3, image.channels()) : 1;
+	if (image.channels() != channels)
+		convert_channels(image, image, channels);
+}
+
+// Output to source mapping. With a camera model the quad is undistorted
+// first, so the mapping ends in undistorted pixels and fill_maps applies the
+// lens distortion to land on the raw frame.
+Mat PPTRestore::Ximpl::inverse_homography_for(const vector<Point2f>& points, Size& size)
+{
+	vector<Point2f> undistorted = points;
+	if (!camera_matrix.empty())
+		undistortPoints(points, undistorted, camera_matrix, dist_coeffs, Mat(), camera_matrix);
+	return homography_for(undistorted, size).inv();
+}
+
+// source coordinates of output rows [first, last) for remap
+void PPTRestore::Ximpl::fill_maps(const Mat& inv, Size size, int first, int last, Mat& map_x, Mat& map_y) const
+{
+	const double* m = inv.ptr<double>();
+	const bool distort = !camera_matrix.empty();
+	double fx = 1, fy = 1, cx = 0, cy = 0, k[8] = { 0 };
+	if (distort)
+	{
+		Mat K, D;
+		camera_matrix.convertTo(K, CV_64F);
+		dist_coeffs.convertTo(D, CV_64F);
+		fx = K.at<double>(0, 0), fy = K.at<double>(1, 1), cx = K.at<double>(0, 2), cy = K.at<double>(1, 2);
+		for (int i = 0; i < min(8, (int)D.total()); ++i)
+			k[i] = D.ptr<double>()[i];
+	}
+
+	map_x.create(last - first, size.width, CV_32FC1);
+	map_y.create(last - first, size.width, CV_32FC1);
+	for (int y = first; y < last; ++y)
+	{
+		float* mx = map_x.ptr<float>(y - first);
+		float* my = map_y.ptr<float>(y - first);
+		for (int x = 0; x < size.width; ++x)
+		{
+			double w = m[6] * x + m[7] * y + m[8];
+			w = w ? 1. / w : 0;
+			double u = (m[0] * x + m[1] * y + m[2]) * w, v = (m[3] * x + m[4] * y + m[5]) * w;
+			if (distort)
+			{
+				// OpenCV's model, coefficients k1 k2 p1 p2 [k3 [k4 k5 k6]], no skew
+				double xn = (u - cx) / fx, yn = (v - cy) / fy;
+				double r2 = xn * xn + yn * yn, r4 = r2 * r2, r6 = r4 * r2;
+				double radial = (1 + k[0] * r2 + k[1] * r4 + k[4] * r6) / (1 + k[5] * r2 + k[6] * r4 + k[7] * r6);
+				double xd = xn * radial + 2 * k[2] * xn * yn + k[3] * (r2 + 2 * xn * xn);
+				double yd = yn * radial + k[2] * (r2 + 2 * yn * yn) + 2 * k[3] * xn * yn;
+				u = xd * fx + cx;
+				v = yd * fy + cy;
+			}
+			mx[x] = (float)u;
+			my[x] = (float)v;
+		}
+	}
+}
+
+// The mapping of every output pixel stored as remap's fixed-point tables:
+// integer coordinates plus a 5-bit interpolation index per axis, the same
+// representation warpPerspective uses internally. A camera model set with
+// set_camera is folded into the same tables.
+void PPTRestore::Ximpl::build_remap(const vector<Point2f>& points, Size frame_size)
+{
+	Size size;
+	Mat inv = inverse_homography_for(points, size);
+	fixed_map1.release();
+	fixed_map2.release();
+	if (size.area() == 0) return;
+
+	Mat map_x, map_y;
+	fill_maps(inv, size, 0, size.height, map_x, map_y);
+	convertMaps(map_x, map_y, fixed_map1, fixed_map2, CV_16SC2);
+	fixed_points = points;
+	fixed_frame_size = frame_size;
+}
+
 Mat PPTRestore::Ximpl::image_enhance(Mat& input)
 {
 	Mat output;
-	Mat kernel = (Mat_<float>(3, 3) << 0, -1, 0, -1, 5, -1, 0, -1, 0);
-	filter2D(input, output, this->srcImage.depth(), kernel);
+	switch (enhance_mode)
+	{
+	case PPTRestore::EnhanceMode::Sharpen:
+		sharpen_8u(input, output);
+		break;
+	case PPTRestore::EnhanceMode::UnsharpMask:
+	{
+		double sigma = unsharp_sigma, amount = unsharp_amount;
+		RowStripes::run(input, output, [=](const Mat& src, Mat& dst) {
+			Mat blurred;
+			GaussianBlur(src, blurred, Size(), sigma);
+			addWeighted(src, 1 + amount, blurred, -amount, 0, dst);
+		});
+		break;
+	}
+	case PPTRestore::EnhanceMode::LocalContrast:
+	{
+		// CLAHE has to see whole tiles, so only the colour conversions are striped
+		auto clahe = createCLAHE(clahe_clip_limit, Size(8, 8));
+		if (input.channels() == 1)
+		{
+			clahe->apply(input, output);
+			break;
+		}
+		Mat lab;
+		RowStripes::run(input, lab, [](const Mat& src, Mat& dst) {cvtColor(src, dst, COLOR_BGR2Lab); });
+		vector<Mat> planes;
+		split(lab, planes);
+		clahe->apply(planes[0], planes[0]);
+		merge(planes, lab);
+		RowStripes::run(lab, output, [](const Mat& src, Mat& dst) {cvtColor(src, dst, COLOR_Lab2BGR); });
+		break;
+	}
+	case PPTRestore::EnhanceMode::FlattenBackground:
+	{
+		// the background is estimated on a thumbnail: dilation removes the ink,
+		// a blur smooths what is left, then every pixel is divided by it
+		Mat small, background;
+		resize(input, small, Size(), 1.0 / background_scale, 1.0 / background_scale, INTER_AREA);
+		dilate(small, small, getStructuringElement(MORPH_RECT, Size(7, 7)));
+		blur(small, small, Size(9, 9));
+		resize(small, background, input.size(), 0, 0, INTER_LINEAR);
+		RowStripes::run(input, output, [&](const Mat& src, Mat& dst) {
+			Size whole;
+			Point stripe_ofs, input_ofs;
+			src.locateROI(whole, stripe_ofs);
+			input.locateROI(whole, input_ofs);
+			int first = stripe_ofs.y - input_ofs.y;
+			divide(src, background.rowRange(first, first + src.rows), dst, 255);
+		});
+		break;
+	}
+	}
 	PPTRestore::tempImg["final"] = output;
 	return output;
 }
 
-vector<Point2f> PPTRestore::get_points(Mat& image)
+Mat PPTRestore::Ximpl::enhance_output(Mat& input)
+{
+	auto output = image_enhance(input);
+	if (output_format == PPTRestore::OutputFormat::Binary)
+	{
+		adaptiveThreshold(output, output, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY, 25, 10);
+		PPTRestore::tempImg["final"] = output;
+	}
+	return output;
+}
+
+// rows of context a tile needs on each side so that enhancing it alone gives
+// the same pixels as enhancing the whole image, -1 if no margin is enough
+int PPTRestore::Ximpl::enhance_margin() const
+{
+	int margin = 0;
+	switch (enhance_mode)
+	{
+	case PPTRestore::EnhanceMode::Sharpen: margin = 1; break;
+	case PPTRestore::EnhanceMode::UnsharpMask: margin = cvCeil(3 * unsharp_sigma) + 1; break;
+	// CLAHE's tile histograms and the background estimate are made from the
+	// whole image, a band would get its own
+	default: return -1;
+	}
+	// the threshold's 25x25 window looks at enhanced pixels, so the two margins add up
+	if (output_format == PPTRestore::OutputFormat::Binary) margin += 25 / 2;
+	return margin;
+}
+
+// rgb: src and dst hold RGB like a PPM; each tile is swapped to BGR for the
+// pipeline and back before it is stored
+void PPTRestore::Ximpl::warp_tiles(const Mat& src, const Mat& inv, Mat& dst, bool rgb)
+{
+	// a mode no margin is enough for is enhanced in one band
+	const int needed = enhance_margin();
+	const int margin = max(0, needed), rows = needed < 0 ? dst.rows : tile_rows;
+	for (int top = 0; top < dst.rows; top += rows)
+	{
+		int bottom = min(dst.rows, top + rows);
+		int first = max(0, top - margin), last = min(dst.rows, bottom + margin);
+
+		Mat tile;
+		if (camera_matrix.empty())
+		{
+			// move the output origin to the first row of this band
+			Mat shift = (Mat_<double>(3, 3) << 1, 0, 0, 0, 1, first, 0, 0, 1);
+			warpPerspective(src, tile, inv * shift, Size(dst.cols, last - first), INTER_LINEAR | WARP_INVERSE_MAP);
+		}
+		else
+		{
+			Mat map_x, map_y;
+			fill_maps(inv, dst.size(), first, last, map_x, map_y);
+			remap(src, tile, map_x, map_y, INTER_LINEAR);
+		}
+		if (rgb && tile.channels() == 3)
+			cvtColor(tile, tile, COLOR_RGB2BGR);
+		if (tile.channels() != dst.channels())
+			convert_channels(tile, tile, dst.channels());
+		Mat enhanced = enhance_output(tile);
+		if (rgb && enhanced.channels() == 3)
+			cvtColor(enhanced, enhanced, COLOR_BGR2RGB);
+		Mat band = dst.rowRange(top, bottom);
+		enhanced.rowRange(top - first, bottom - first).copyTo(band);
+	}
+}
+
+static double ms_since(int64 start)
+{
+	return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+static DetectionLog::Record record_of(const PPTRestore::Detection& detection, double timestamp, double min_confidence)
+{
+	auto record = DetectionLog::make_record(detection.points, timestamp);
+	record.confidence = (float)detection.confidence;
+	record.preprocess_ms = (float)detection.preprocess_ms;
+	record.lines_ms = (float)detection.lines_ms;
+	record.corners_ms = (float)detection.corners_ms;
+	record.flags = (detection.confidence >= min_confidence ? DetectionLog::Found : 0) |
+		(detection.fallback ? DetectionLog::Fallback : 0) | (detection.truncated ? DetectionLog::Truncated : 0);
+	record.verified_corners = detection.verified_corners;
+	return record;
+}
+
+PPTRestore::Detection PPTRestore::detect(Mat& image, double budget_ms)
 {
 	PPTRestore::tempImg["raw"] = image;
+	this->pImpl->truncated = false;
+	this->pImpl->deadline = budget_ms > 0 ? getTickCount() + (int64)(budget_ms * getTickFrequency() / 1000) : 0;
+	Detection detection;
+	if (!this->pImpl->extreme_crop)
+		detection = detect_band(image);
+	else
+	{
+		// very wide or tall input: detect in the content band only
+		detection = detect_band(this->pImpl->helper.cut(image));
+		detection.points = this->pImpl->helper.deal(detection.points);
+	}
+	if (this->pImpl->log)
+		this->pImpl->log->append(record_of(detection, this->pImpl->frame_time, this->pImpl->min_confidence));
+	this->pImpl->frame_time = -1;
+	return detection;
+}
+
+PPTRestore::Detection PPTRestore::detect_band(Mat& image)
+{
+	Detection detection;
 	this->pImpl->srcImage = image;
+	this->pImpl->substituted_corners = 0;
+	this->pImpl->overlay.clear();
+	int64 start = getTickCount();
 	auto after_preprocess = this->pImpl->preprocess_image(image);
+	detection.preprocess_ms = ms_since(start);
+	if (!this->pImpl->quad_points.empty())
+	{
+		++this->pImpl->stats.fast_path_hits;
+		detection.points = this->pImpl->quad_points;
+		detection.confidence = this->pImpl->quad_confidence(detection.points);
+		return detection;
+	}
 
-	//auto corners = this->pImpl->corner_dectection(after_preprocess);
-
+	// out of time already: the centre contour's rectangle is the best guess there is
+	if (this->pImpl->out_of_time())
+	{
+		++this->pImpl->stats.truncated;
+		detection.truncated = true;
+		detection.fallback = true;
+		detection.points = { Point2f(0, 0), Point2f(image.cols, 0), Point2f(0, image.rows), Point2f(image.cols, image.rows) };
+		if (this->pImpl->center_rect.size.area() > 0)
+		{
+			Point2f pts[4];
+			this->pImpl->center_rect.points(pts);
+			detection.points = corner_order(vector<Point2f>(pts, pts + 4));
+			detection.confidence = this->pImpl->quad_confidence(detection.points);
+		}
+		return detection;
+	}
+	++this->pImpl->stats.hough_path_runs;
 
+	start = getTickCount();
 	auto lines = this->pImpl->edge_detection(after_preprocess);
-	cout << lines.size() << endl;
-	if (lines.empty())return{ Point2f(0, 0), Point2f(image.cols, 0), Point2f(0, image.rows), Point2f(image.cols, image.rows) };
+	if (lines.empty())
+	{
+		detection.lines_ms = ms_since(start);
+		detection.points = { Point2f(0, 0), Point2f(image.cols, 0), Point2f(0, image.rows), Point2f(image.cols, image.rows) };
+		detection.fallback = true;
+		detection.truncated = this->pImpl->truncated;
+		this->pImpl->stats.truncated += detection.truncated;
+		return detection;
+	}
 
 	auto final_points_new = this->pImpl->cal_points_with_lines(lines);
-	//auto points_with_ratio = this->pImpl->find_cross_points_by_edges(lines);
+	detection.lines_ms = ms_since(start);
+	if (this->pImpl->corner_refine && !this->pImpl->out_of_time())
+	{
+		start = getTickCount();
+		detection.verified_corners = this->pImpl->refine_corners(final_points_new);
+		this->pImpl->stats.corners_verified += detection.verified_corners;
+		detection.corners_ms = ms_since(start);
+	}
+	detection.points = final_points_new;
+	detection.fallback = this->pImpl->substituted_corners > 0;
+	detection.confidence = this->pImpl->quad_confidence(final_points_new);
+	detection.truncated = this->pImpl->truncated;
+	this->pImpl->stats.truncated += detection.truncated;
+	return detection;
+}
 
-	// auto final_points = this->pImpl->edge_corner_candidates(points_with_ratio, corners);
-	get_image(image, final_points_new);
-	return final_points_new;
+// Fingerprint of the settings that change the quad, or with output also of
+// those that change the rectified image, so objects sharing a result cache
+// never get each other's results.
+uint64 PPTRestore::Ximpl::settings_key(bool output) const
+{
+	vector<uchar> bytes;
+	auto add = [&](const void* p, size_t n) { bytes.insert(bytes.end(), (const uchar*)p, (const uchar*)p + n); };
+	auto add_mat = [&](const Mat& m) {
+		Mat c = m.isContinuous() ? m : m.clone();
+		int type = c.type();
+		add(&type, sizeof(type));
+		add(&c.rows, sizeof(c.rows));
+		add(&c.cols, sizeof(c.cols));
+		add(c.data, c.total() * c.elemSize());
+	};
+	const bool detect_flags[] = { contour_fast_path, hough_roi, corner_refine, extreme_crop };
+	const double detect_params[] = { fast_path_max_cosine, fast_path_min_area_ratio, screen_min_area_ratio,
+		hough_band_ratio, (double)hough_band_min, corner_window_ratio, (double)corner_window_min, corner_min_response };
+	add(detect_flags, sizeof(detect_flags));
+	add(detect_params, sizeof(detect_params));
+	if (output)
+	{
+		const int modes[] = { (int)enhance_mode, (int)output_format, background_scale };
+		const double params[] = { unsharp_sigma, unsharp_amount, clahe_clip_limit };
+		add(modes, sizeof(modes));
+		add(params, sizeof(params));
+		add_mat(camera_matrix);
+		add_mat(dist_coeffs);
+	}
+	return ResultCache::content_key(bytes);
+}
+
+static uint64 mix_key(uint64 key, uint64 settings)
+{
+	return (key ^ settings) * 0x9e3779b97f4a7c15ULL ^ settings >> 29;
+}
+
+// Reads the file, shows it and its rectified, enhanced version. With a result
+// cache an input seen before reuses its quad, or its whole encoded result when
+// that was made with the same settings.
+void PPTRestore::imageRestoreAndEnhance(const string name)
+{
+	ifstream in(name, ios::binary);
+	vector<uchar> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	if (bytes.empty())
+	{
+		cout << "can't read " << name << endl;
+		return;
+	}
+
+	auto cache = this->pImpl->cache;
+	ResultCache::Entry entry;
+	uint64 detect_settings = cache ? this->pImpl->settings_key(false) : 0;
+	uint64 output_settings = cache ? this->pImpl->settings_key(true) : 0;
+	uint64 key = cache ? mix_key(ResultCache::content_key(bytes), detect_settings) : 0, perceptual = 0;
+	bool exact = cache && cache->find(key, entry);
+	if (exact && !entry.output.empty() && entry.output_settings == output_settings)
+	{
+		this->pImpl->debug->show_img(WINDOW_NAME3, imdecode(entry.output, IMREAD_UNCHANGED));
+		return;
+	}
+
+	Mat image = imdecode(bytes, IMREAD_COLOR);
+	if (image.empty())
+	{
+		cout << "can't decode " << name << endl;
+		return;
+	}
+	this->pImpl->debug->show_img(WINDOW_NAME1, image);
+	bool cached = exact;
+	// an exact hit is stored again only to replace output made with other settings
+	bool store = cache && (!exact || cache->keep_output());
+	if (store)
+		perceptual = mix_key(ResultCache::perceptual_key(image), detect_settings);
+	if (cache && !exact)
+		cached = cache->find_perceptual(perceptual, entry);
+
+	Detection detection;
+	if (cached)
+	{
+		for (auto p : entry.points)
+			detection.points.emplace_back(p.x * image.cols, p.y * image.rows);
+		detection.confidence = entry.confidence;
+	}
+	if (cached && !exact)
+	{
+		// the thumbnail hash also matches a slightly moved camera or another
+		// slide on the same screen: the borrowed quad has to fit this frame's edges
+		this->pImpl->srcImage = image;
+		this->pImpl->substituted_corners = 0;
+		this->pImpl->frame_edges(image);
+		detection.confidence = detection.points.size() == 4 ? this->pImpl->quad_confidence(detection.points) : 0;
+		cached = detection.confidence >= this->pImpl->min_confidence;
+	}
+	if (!cached)
+		detection = detect(image);
+
+	Mat result;
+	if (detection.confidence < this->pImpl->min_confidence)
+	{
+		++this->pImpl->stats.low_confidence;
+		cout << "no slide found in " << name << endl;
+	}
+	else
+	{
+		result = get_image(image, detection.points);
+		this->pImpl->debug->show_img(WINDOW_NAME3, result);
+	}
+
+	if (!store) return;
+	entry = ResultCache::Entry();
+	for (auto p : detection.points)
+		entry.points.emplace_back(p.x / image.cols, p.y / image.rows);
+	entry.confidence = detection.confidence;
+	if (cache->keep_output() && !result.empty())
+		imencode(".png", result, entry.output);
+	entry.output_settings = output_settings;
+	cache->insert(key, perceptual, entry);
+}
+
+// Every screen in the frame from the one shared edge map, left to right,
+// instead of only the contour nearest the centre
+vector<PPTRestore::Detection> PPTRestore::detect_all(Mat& image)
+{
+	PPTRestore::tempImg["raw"] = image;
+	this->pImpl->srcImage = image;
+	this->pImpl->substituted_corners = 0;
+	this->pImpl->truncated = false;
+	this->pImpl->deadline = 0;
+	this->pImpl->overlay.clear();
+	this->pImpl->preprocess_image(image);
+
+	vector<Detection> detections;
+	for (auto& quad : this->pImpl->screen_quads())
+	{
+		Detection detection;
+		if (this->pImpl->corner_refine)
+		{
+			detection.verified_corners = this->pImpl->refine_corners(quad);
+			this->pImpl->stats.corners_verified += detection.verified_corners;
+		}
+		detection.points = quad;
+		detection.confidence = this->pImpl->quad_confidence(quad, this->pImpl->screen_min_area_ratio);
+		detections.push_back(detection);
+	}
+	sort(detections.begin(), detections.end(), [](const Detection& d1, const Detection& d2) {
+		return d1.points[0].x + d1.points[2].x < d2.points[0].x + d2.points[2].x; });
+	return detections;
+}
+
+vector<Mat> PPTRestore::get_images(Mat& image)
+{
+	vector<Mat> images;
+	for (const auto& detection : detect_all(image))
+	{
+		if (detection.confidence < this->pImpl->min_confidence)
+		{
+			++this->pImpl->stats.low_confidence;
+			continue;
+		}
+		images.push_back(get_image(image, detection.points));
+	}
+	return images;
+}
+
+vector<Point2f> PPTRestore::get_points(Mat& image, double budget_ms)
+{
+	auto detection = detect(image, budget_ms);
+	if (detection.confidence < this->pImpl->min_confidence)
+	{
+		++this->pImpl->stats.low_confidence;
+		return detection.points;
+	}
+	get_image(image, detection.points);
+	return detection.points;
 }
 
 Mat PPTRestore::get_image(Mat& image, const vector<Point2f>& points)
 {
 	auto after_transform = this->pImpl->perspective_transformation(points, image);
-	auto final_mat = this->pImpl->image_enhance(after_transform);
+	auto final_mat = this->pImpl->enhance_output(after_transform);
 	return final_mat;
 }
 
+bool PPTRestore::rectify_mapped(const string& src_path, const string& dst_path)
+{
+	MappedImage input;
+	if (!input.open(src_path)) return false;
+	Mat& src = input.mat();
+
+	// detect on a thumbnail, only the warp reads full resolution pixels
+	double scale = min(1.0, (double)this->pImpl->mapped_detect_side / max(src.cols, src.rows));
+	Mat thumb;
+	resize(src, thumb, Size(), scale, scale, INTER_AREA);
+	// a PPM is RGB, the pipeline expects BGR
+	cvtColor(thumb, thumb, thumb.channels() == 1 ? COLOR_GRAY2BGR : COLOR_RGB2BGR);
+	auto detection = detect(thumb);
+	if (detection.confidence < this->pImpl->min_confidence)
+	{
+		++this->pImpl->stats.low_confidence;
+		return false;
+	}
+	for (auto& p : detection.points)
+		p *= 1.0 / scale;
+
+	Size size;
+	Mat inv = this->pImpl->inverse_homography_for(detection.points, size);
+	int channels = this->pImpl->output_format == OutputFormat::Color ? src.channels() : 1;
+	MappedImage output;
+	if (size.area() == 0 || !output.create(dst_path, size, channels)) return false;
+	this->pImpl->warp_tiles(src, inv, output.mat(), src.channels() == 3);
+	return true;
+}
+
+
+
+Mat PPTRestore::wrap(const ImageView& view)
+{
+	static const int types[] = { CV_8UC1, CV_8UC3, CV_8UC4 };
+	if (!view.data || view.width <= 0 || view.height <= 0) return Mat();
+	return Mat(view.height, view.width, types[(int)view.format], view.data, view.stride ? view.stride : Mat::AUTO_STEP);
+}
+
+PPTRestore::ImageView PPTRestore::view_of(Mat& mat)
+{
+	ImageView view;
+	view.data = mat.data;
+	view.width = mat.cols;
+	view.height = mat.rows;
+	view.stride = mat.step[0];
+	view.format = mat.channels() == 1 ? PixelFormat::Gray8 : mat.channels() == 3 ? PixelFormat::BGR8 : PixelFormat::BGRA8;
+	return view;
+}
+
+PPTRestore::Detection PPTRestore::detect(const ImageView& src, double budget_ms)
+{
+	Mat image = wrap(src);
+	if (image.empty()) return Detection();
+	auto detection = detect(image, budget_ms);
+	// don't keep headers on the caller's buffer past the call
+	PPTRestore::tempImg.erase("raw");
+	this->pImpl->srcImage.release();
+	this->pImpl->grayImage.release();
+	this->pImpl->helper.release();
+	return detection;
+}
+
+bool PPTRestore::get_image(const ImageView& src, const vector<Point2f>& points, const ImageView& dst)
+{
+	Mat image = wrap(src), out = wrap(dst);
+	if (image.empty() || out.empty() || points.size() != 4) return false;
+	Size size;
+	Mat inv = this->pImpl->inverse_homography_for(points, size);
+	if (size.area() == 0) return false;
+	// stretch the quad over the whole destination
+	Mat scale = (Mat_<double>(3, 3) << (double)size.width / out.cols, 0, 0, 0, (double)size.height / out.rows, 0, 0, 0, 1);
+	inv = inv * scale;
+
+	// enhancement works on gray or BGR; other destination layouts get one conversion at the end
+	int channels = this->pImpl->output_format == OutputFormat::Color ? min(3, out.channels()) : 1;
+	if (channels == out.channels())
+	{
+		this->pImpl->warp_tiles(image, inv, out);
+		return true;
+	}
+	Mat rectified(out.size(), CV_8UC(channels));
+	this->pImpl->warp_tiles(image, inv, rectified);
+	convert_channels(rectified, out, out.channels());
+	return true;
+}
+
+bool PPTRestore::restore(const ImageView& src, const ImageView& dst, Detection* detection)
+{
+	auto found = detect(src);
+	if (detection) *detection = found;
+	if (found.confidence < this->pImpl->min_confidence)
+	{
+		++this->pImpl->stats.low_confidence;
+		return false;
+	}
+	return get_image(src, found.points, dst);
+}
+
+// Frames are read from the input ring and rectified straight into the next
+// output slot; stops when the input is empty or the output is full. A frame
+// below min_confidence is consumed without producing output.
+int PPTRestore::rectify_ring(FrameRing& input, FrameRing& output)
+{
+	int consumed = 0;
+	Mat frame, slot;
+	double timestamp;
+	while (output.begin_write(slot) && input.begin_read(frame, &timestamp))
+	{
+		this->pImpl->frame_time = timestamp;
+		auto detection = detect(view_of(frame));
+		if (detection.confidence < this->pImpl->min_confidence)
+			++this->pImpl->stats.low_confidence;
+		else if (get_image(view_of(frame), detection.points, view_of(slot)))
+			output.end_write(timestamp);
+		input.end_read();
+		++consumed;
+	}
+	return consumed;
+}
+
+void PPTRestore::set_contour_fast_path(bool enable)
+{
+	this->pImpl->contour_fast_path = enable;
+}
+
+void PPTRestore::set_min_confidence(double confidence)
+{
+	this->pImpl->min_confidence = confidence;
+}
+
+void PPTRestore::set_enhance_mode(EnhanceMode mode)
+{
+	this->pImpl->enhance_mode = mode;
+}
+
+void PPTRestore::set_output_format(OutputFormat format)
+{
+	this->pImpl->output_format = format;
+}
+
+void PPTRestore::set_tile_rows(int rows)
+{
+	this->pImpl->tile_rows = max(1, rows);
+}
+
+void PPTRestore::set_debug_overlay(bool enable)
+{
+	this->pImpl->overlay.enabled = enable;
+}
+
+vector<string> PPTRestore::overlay_layers() const
+{
+	return this->pImpl->overlay.names();
+}
+
+Mat PPTRestore::render_overlay(const string& layer, const Mat& background) const
+{
+	return this->pImpl->overlay.render(layer, background);
+}
+
+void PPTRestore::set_hough_roi(bool enable)
+{
+	this->pImpl->hough_roi = enable;
+}
+
+void PPTRestore::set_corner_refine(bool enable)
+{
+	this->pImpl->corner_refine = enable;
+}
+
+void PPTRestore::set_extreme_crop(bool enable)
+{
+	this->pImpl->extreme_crop = enable;
+}
+
+void PPTRestore::set_cancel_flag(const atomic<bool>* flag)
+{
+	this->pImpl->cancel = flag;
+}
+
+double PPTRestore::min_confidence() const
+{
+	return this->pImpl->min_confidence;
+}
+
+PPTRestore::ThreadBudget PPTRestore::set_threading_policy(ThreadingPolicy policy, int cores)
+{
+	if (cores <= 0) cores = getNumberOfCPUs();
+	ThreadBudget budget;
+	switch (policy)
+	{
+	case ThreadingPolicy::InterImage:
+		budget = { cores, 1 };
+		break;
+	case ThreadingPolicy::IntraImage:
+		budget = { 1, cores };
+		break;
+	case ThreadingPolicy::Hybrid:
+		budget.workers = max(1, cvRound(sqrt((double)cores)));
+		budget.threads_per_image = max(1, cores / budget.workers);
+		break;
+	}
+	// parallel_for_ inside Canny, warpPerspective, RowStripes and friends all
+	// draw from this one pool
+	setNumThreads(budget.threads_per_image);
+	return budget;
+}
+
+bool PPTRestore::build_fixed_geometry(Mat& reference)
+{
+	auto detection = detect(reference);
+	if (detection.confidence < this->pImpl->min_confidence) return false;
+	return build_fixed_geometry(detection.points, reference.size());
+}
+
+bool PPTRestore::build_fixed_geometry(const vector<Point2f>& points, Size frame_size)
+{
+	if (points.size() != 4) return false;
+	this->pImpl->build_remap(points, frame_size);
+	return !this->pImpl->fixed_map1.empty();
+}
+
+static const char fixed_geometry_magic[8] = "PPTMAP1";
+
+// magic, frame size, the four points, table size, then both tables row by row
+bool PPTRestore::save_fixed_geometry(const string& path) const
+{
+	const Mat& map1 = this->pImpl->fixed_map1;
+	const Mat& map2 = this->pImpl->fixed_map2;
+	if (map1.empty()) return false;
+	ofstream out(path, ios::binary);
+	if (!out) return false;
+
+	int sizes[4] = { this->pImpl->fixed_frame_size.width, this->pImpl->fixed_frame_size.height, map1.cols, map1.rows };
+	out.write(fixed_geometry_magic, sizeof(fixed_geometry_magic));
+	out.write((const char*)sizes, sizeof(sizes));
+	out.write((const char*)this->pImpl->fixed_points.data(), 4 * sizeof(Point2f));
+	for (int y = 0; y < map1.rows; ++y)
+		out.write((const char*)map1.ptr(y), map1.cols * map1.elemSize());
+	for (int y = 0; y < map2.rows; ++y)
+		out.write((const char*)map2.ptr(y), map2.cols * map2.elemSize());
+	return (bool)out;
+}
+
+bool PPTRestore::load_fixed_geometry(const string& path)
+{
+	ifstream in(path, ios::binary);
+	char magic[sizeof(fixed_geometry_magic)];
+	int sizes[4];
+	vector<Point2f> points(4);
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, fixed_geometry_magic, sizeof(magic)) != 0) return false;
+	if (!in.read((char*)sizes, sizeof(sizes)) || !in.read((char*)points.data(), 4 * sizeof(Point2f))) return false;
+	// remap's fixed-point tables hold 16-bit coordinates, nothing larger can be
+	// valid, and the tables have to be exactly what is left of the file
+	const int limit = SHRT_MAX;
+	for (int s : sizes)
+		if (s <= 0 || s > limit) return false;
+	streamoff tables = in.tellg();
+	in.seekg(0, ios::end);
+	streamoff remaining = in.tellg() - tables;
+	in.seekg(tables);
+	if (remaining != (streamoff)sizes[2] * sizes[3] * (2 * sizeof(short) + sizeof(ushort))) return false;
+
+	Mat map1(sizes[3], sizes[2], CV_16SC2), map2(sizes[3], sizes[2], CV_16UC1);
+	in.read((char*)map1.data, map1.total() * map1.elemSize());
+	in.read((char*)map2.data, map2.total() * map2.elemSize());
+	if (!in) return false;
+
+	this->pImpl->fixed_points = points;
+	this->pImpl->fixed_frame_size = Size(sizes[0], sizes[1]);
+	this->pImpl->fixed_map1 = map1;
+	this->pImpl->fixed_map2 = map2;
+	return true;
+}
+
+void PPTRestore::clear_fixed_geometry()
+{
+	this->pImpl->fixed_points.clear();
+	this->pImpl->fixed_frame_size = Size();
+	this->pImpl->fixed_map1.release();
+	this->pImpl->fixed_map2.release();
+}
+
+// empty when no tables are loaded or the frame has a different size
+Mat PPTRestore::rectify_fixed(const Mat& frame)
+{
+	if (this->pImpl->fixed_map1.empty() || frame.size() != this->pImpl->fixed_frame_size) return Mat();
+	Mat warped;
+	remap(frame, warped, this->pImpl->fixed_map1, this->pImpl->fixed_map2, INTER_LINEAR);
+	this->pImpl->to_output_channels(warped);
+	return this->pImpl->enhance_output(warped);
+}
+
+// 32x24 thumbnail scaled to zero mean and unit deviation, so exposure
+// changes don't look like a new slide
+static Mat slide_signature(const Mat& rectified)
+{
+	Mat gray, thumb, signature;
+	if (rectified.channels() != 1) convert_channels(rectified, gray, 1);
+	else gray = rectified;
+	resize(gray, thumb, Size(32, 24), 0, 0, INTER_AREA);
+	Scalar mean, stddev;
+	meanStdDev(thumb, mean, stddev);
+	thumb.convertTo(signature, CV_32F, 1 / max(stddev[0], 8.0), -mean[0] / max(stddev[0], 8.0));
+	return signature;
+}
+
+PPTRestore::SlideFrame PPTRestore::next_frame(Mat& frame, double timestamp, Mat& slide)
+{
+	SlideFrame result;
+	result.timestamp = timestamp;
+	slide.release();
+
+	Mat rectified;
+	if (!this->pImpl->fixed_map1.empty() && frame.size() == this->pImpl->fixed_frame_size)
+	{
+		remap(frame, rectified, this->pImpl->fixed_map1, this->pImpl->fixed_map2, INTER_LINEAR);
+		this->pImpl->to_output_channels(rectified);
+		result.points = this->pImpl->fixed_points;
+		if (this->pImpl->log)
+		{
+			// the fixed quad stands in for a detection, so the log still has every frame
+			auto record = DetectionLog::make_record(result.points, timestamp);
+			record.confidence = 1;
+			record.flags = DetectionLog::Found;
+			this->pImpl->log->append(record);
+		}
+	}
+	else
+	{
+		this->pImpl->frame_time = timestamp;
+		auto detection = detect(frame);
+		if (detection.confidence < this->pImpl->min_confidence)
+		{
+			++this->pImpl->stats.low_confidence;
+			return result;
+		}
+		rectified = this->pImpl->perspective_transformation(detection.points, frame);
+		result.points = detection.points;
+	}
+
+	auto& impl = *this->pImpl;
+	Mat signature = slide_signature(rectified);
+	auto distance = [](const Mat& a, const Mat& b) { return norm(a, b, NORM_L1) / a.total(); };
+	result.changed = impl.slide_signature.empty();
+	if (!result.changed && distance(signature, impl.slide_signature) > impl.slide_change_threshold)
+	{
+		// hands and transitions move, wait until the new content holds still
+		bool steady = !impl.pending_signature.empty() && distance(signature, impl.pending_signature) <= impl.slide_change_threshold;
+		impl.pending_frames = steady ? impl.pending_frames + 1 : 1;
+		impl.pending_signature = signature;
+		result.changed = impl.pending_frames >= impl.slide_settle_frames;
+	}
+	else
+	{
+		// back on the current slide: the candidate is abandoned, a later frame
+		// must not count as holding still against it
+		impl.pending_frames = 0;
+		impl.pending_signature.release();
+	}
+
+	if (result.changed)
+	{
+		impl.slide_signature = signature;
+		impl.pending_signature.release();
+		impl.pending_frames = 0;
+		++impl.slide_count;
+		slide = impl.enhance_output(rectified);
+	}
+	result.slide = impl.slide_count - 1;
+	return result;
+}
+
+void PPTRestore::reset_slides()
+{
+	this->pImpl->slide_signature.release();
+	this->pImpl->pending_signature.release();
+	this->pImpl->slide_count = 0;
+	this->pImpl->pending_frames = 0;
+}
+
+void PPTRestore::set_slide_change_threshold(double threshold)
+{
+	this->pImpl->slide_change_threshold = threshold;
+}
+
+bool PPTRestore::write_slide_index(const string& path, const vector<SlideFrame>& frames)
+{
+	ofstream out(path);
+	if (!out) return false;
+	for (const auto& f : frames)
+	{
+		out << f.timestamp << ' ' << f.slide;
+		for (auto p : f.points)
+			out << ' ' << p.x << ' ' << p.y;
+		out << '\n';
+	}
+	return (bool)out;
+}
+
+void PPTRestore::set_camera(const Mat& camera_matrix, const Mat& dist_coeffs)
+{
+	this->pImpl->camera_matrix = camera_matrix.clone();
+	this->pImpl->dist_coeffs = dist_coeffs.clone();
+}
+
+void PPTRestore::set_result_cache(shared_ptr<ResultCache> cache)
+{
+	this->pImpl->cache = cache;
+}
+
+void PPTRestore::set_detection_log(shared_ptr<DetectionLog> log)
+{
+	this->pImpl->log = log;
+}
+
+PPTRestore::Statistics PPTRestore::statistics() const
+{
+	return this->pImpl->stats;
+}
\ No newline at end of file
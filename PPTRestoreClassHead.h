@@ -9,6 +9,12 @@
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/ml/ml.hpp>  
 #include <memory>
+#include <map>
+#include <queue>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <atomic>
 using namespace cv;
 using namespace std;
 #define WINDOW_NAME1 "ԭʼͼڡ"			 
@@ -35,18 +41,246 @@ struct CmpDistanceToZero//
 		return lhs.x + lhs.y < rhs.x + rhs.y;
 	}
 };
+class ResultCache;
+class FrameRing;
+class DetectionLog;
 class PPTRestore
 {
 public:
+	struct Statistics
+	{
+		size_t fast_path_hits = 0;  // quads taken straight from approxPolyDP
+		size_t hough_path_runs = 0; // frames that went through HoughLinesP
+		size_t low_confidence = 0;  // detections not warped because of a low score
+		size_t corners_verified = 0; // line corners confirmed by the windowed corner response
+		size_t truncated = 0;        // detections cut short by their time budget
+	};
+
+	struct Detection
+	{
+		vector<Point2f> points;   // left_top, right_top, left_down, right_down
+		double confidence = 0;    // 0..1, edge support * convexity * area ratio
+		bool fallback = false;    // some corner is an image corner, not a detected one
+		int verified_corners = 0; // corners moved onto a corner response peak
+		bool truncated = false;   // the time budget ran out, points are the best so far
+		double preprocess_ms = 0, lines_ms = 0, corners_ms = 0; // time spent in each stage
+	};
+
+	enum class EnhanceMode
+	{
+		Sharpen,           // 3x3 sharpen kernel
+		UnsharpMask,       // original plus a weighted high-pass of a Gaussian blur
+		LocalContrast,     // CLAHE on the luminance channel
+		FlattenBackground  // divide out a smooth background estimate, for whiteboards
+	};
+
+	enum class OutputFormat
+	{
+		Color,  // BGR, as captured
+		Gray,   // luminance only, warped and enhanced as one channel
+		Binary  // Gray followed by adaptive thresholding, for OCR
+	};
+
+	enum class ThreadingPolicy
+	{
+		InterImage,  // one OpenCV thread per image, many images at once
+		IntraImage,  // one image at a time, OpenCV uses every core
+		Hybrid       // a few images at once, a few threads each
+	};
+
 	PPTRestore();
 	PPTRestore(const PPTRestore&);
 	PPTRestore(PPTRestore&&);
 	PPTRestore& operator=(PPTRestore other);
 	~PPTRestore();
 	void imageRestoreAndEnhance(const string name);//ͼԭǿ
+	// budget_ms > 0 bounds the detection time; when it runs out the best quad
+	// found so far comes back with Detection::truncated set
+	Detection detect(Mat& image, double budget_ms = 0);
+	vector<Point2f> get_points(Mat& image, double budget_ms = 0);
+	Mat get_image(Mat& image, const vector<Point2f>& points);
+	// several screens in one frame: every screen-like quad, left to right, and
+	// the rectified images of those above min_confidence
+	vector<Detection> detect_all(Mat& image);
+	vector<Mat> get_images(Mat& image);
+
+	// embedding: pixels stay in buffers the caller owns and are wrapped, not
+	// copied. get_image stretches the quad over the whole of dst and writes the
+	// enhanced result straight into it, converting to dst's format if needed;
+	// restore is detect + get_image and leaves dst alone below min_confidence
+	enum class PixelFormat { Gray8, BGR8, BGRA8 };
+	struct ImageView
+	{
+		unsigned char* data = nullptr;
+		int width = 0, height = 0;
+		size_t stride = 0;      // bytes per row, 0 for packed rows
+		PixelFormat format = PixelFormat::BGR8;
+	};
+	static Mat wrap(const ImageView& view);
+	static ImageView view_of(Mat& mat);
+	Detection detect(const ImageView& src, double budget_ms = 0);
+	bool get_image(const ImageView& src, const vector<Point2f>& points, const ImageView& dst);
+	bool restore(const ImageView& src, const ImageView& dst, Detection* detection = nullptr);
+
+	// shared memory transport: frames rectified in place from the capture ring
+	// into the output ring, returns the number of input frames consumed
+	int rectify_ring(FrameRing& input, FrameRing& output);
+
+	// PPM/PGM in and out through memory mappings, warped a band of rows at a time
+	bool rectify_mapped(const string& src_path, const string& dst_path);
+
+	// fixed camera: the quad is detected (or given) once, turned into fixed-point
+	// remap tables that can be saved and loaded, and every later frame of the same
+	// size is rectified by rectify_fixed with a table lookup
+	bool build_fixed_geometry(Mat& reference);
+	bool build_fixed_geometry(const vector<Point2f>& points, Size frame_size);
+	bool save_fixed_geometry(const string& path) const;
+	bool load_fixed_geometry(const string& path);
+	void clear_fixed_geometry();
+	Mat rectify_fixed(const Mat& frame);
+
+	// video: every frame is rectified (through the fixed tables when they fit),
+	// but only the first frame of a new slide is enhanced; slide stays empty for
+	// frames that repeat the current slide
+	struct SlideFrame
+	{
+		double timestamp = 0;
+		int slide = -1;          // 0, 1, ... in order of appearance, -1 if none was found
+		vector<Point2f> points;
+		bool changed = false;    // first frame of a new slide
+	};
+	SlideFrame next_frame(Mat& frame, double timestamp, Mat& slide);
+	void reset_slides();
+	void set_slide_change_threshold(double threshold);
+	// one "timestamp slide x0 y0 ... x3 y3" line per frame
+	static bool write_slide_index(const string& path, const vector<SlideFrame>& frames);
+
+	void set_contour_fast_path(bool enable);
+	void set_min_confidence(double confidence);
+	void set_enhance_mode(EnhanceMode mode);
+	void set_output_format(OutputFormat format);
+	void set_tile_rows(int rows);
+	void set_hough_roi(bool enable);
+	void set_corner_refine(bool enable);
+	// panoramas and long screenshots are cropped to their content band before detection
+	void set_extreme_crop(bool enable);
+	// detect stops at its next deadline check once *flag is set, as if out of time
+	void set_cancel_flag(const atomic<bool>* flag);
+	double min_confidence() const;
+	// 3x3 intrinsics and OpenCV distortion coefficients of the raw frames, empty
+	// to turn off; undistortion then happens inside the rectifying warp
+	void set_camera(const Mat& camera_matrix, const Mat& dist_coeffs);
+	// consulted by imageRestoreAndEnhance, may be shared by several objects; null to turn off
+	void set_result_cache(shared_ptr<ResultCache> cache);
+	// every detect, and every next_frame on fixed geometry, appends a record; the
+	// timestamps of next_frame and rectify_ring are kept, other frames are numbered
+	void set_detection_log(shared_ptr<DetectionLog> log);
+
+	// diagnostics: the stages record points, lines and contours per layer
+	// ("contours", "hull", "center", "lines", "cross_points", ...) while enabled,
+	// render_overlay draws one layer on a copy of the given background
+	void set_debug_overlay(bool enable);
+	vector<string> overlay_layers() const;
+	Mat render_overlay(const string& layer, const Mat& background) const;
+	Statistics statistics() const;
+
+	// OpenCV's worker threads are process wide: InterImage gives every image one
+	// thread and expects the caller to run several PPTRestore workers, IntraImage
+	// runs one image at a time on all cores, Hybrid splits the cores into about
+	// sqrt(cores) workers with the rest of the cores each
+	struct ThreadBudget
+	{
+		int workers;
+		int threads_per_image;
+	};
+	static ThreadBudget set_threading_policy(ThreadingPolicy policy, int cores = 0);
+
+	static thread_local unordered_map<string, Mat> tempImg;
 private:
+	Detection detect_band(Mat& image);
 	struct Ximpl;
 	Ximpl* pImpl;
 };
 
+// Line segments in structure-of-arrays form. Each one is stored as the
+// homogeneous line through its end points, scaled so that (a, b) is the unit
+// normal: two lines meet at their cross product, a*x + b*y + c is the signed
+// distance of a point, and vertical lines need no special case.
+class LineSet
+{
+public:
+	LineSet() {}
+	explicit LineSet(const vector<Vec4f>& segments);
+	void push_back(const Vec4f& segment);
+	size_t size() const { return a.size(); }
+
+	// intersections of all pairs i < j lying in [lo, hi], appended in (i, j) order;
+	// first/last restrict i so the caller can run the loop in pieces
+	void intersect_all(Point2f lo, Point2f hi, vector<Point2f>& out, int first = 0, int last = -1) const;
+	// distance from every point to its nearest line
+	void min_distances(const vector<Point2f>& pts, vector<float>& out) const;
+	// |cos| of the angle between two lines
+	float cos_angle(int i, int j) const { return fabs(a[i] * a[j] + b[i] * b[j]); }
+	static float cos_angle(const Vec4f& l1, const Vec4f& l2);
+
+	vector<float> a, b, c;
+};
+
+// Results of earlier inputs, keyed by a hash of the encoded file bytes and by
+// a 9x8 difference hash of a thumbnail, so the same slide arriving again costs
+// a hash, and a re-encoded or resized copy of it skips detection. The least
+// recently used entries go first once max_bytes is exceeded. Thread safe.
+class ResultCache
+{
+public:
+	struct Entry
+	{
+		vector<Point2f> points; // quad in 0..1 image coordinates
+		double confidence = 0;
+		vector<uchar> output;   // encoded result, kept only with keep_output
+		uint64 output_settings = 0; // fingerprint of the settings the output was made with
+	};
+
+	struct Counters
+	{
+		size_t hits = 0;            // same encoded bytes
+		size_t perceptual_hits = 0; // other bytes, same thumbnail hash
+		size_t misses = 0;
+		size_t evictions = 0;
+	};
+
+	explicit ResultCache(size_t max_bytes = 64 << 20, bool keep_output = false);
+	static uint64 content_key(const vector<uchar>& bytes);
+	static uint64 perceptual_key(const Mat& image);
+
+	// a lookup is find, then find_perceptual when the bytes are unknown;
+	// the second one counts the miss
+	bool find(uint64 key, Entry& entry);
+	bool find_perceptual(uint64 key, Entry& entry);
+	void insert(uint64 key, uint64 perceptual, const Entry& entry);
+	bool keep_output() const { return keep; }
+	Counters counters() const;
+
+private:
+	struct Item
+	{
+		uint64 key, perceptual;
+		Entry entry;
+	};
+	bool found(list<Item>::iterator it, Entry& entry);
+	static size_t bytes_of(const Entry& entry);
+
+	size_t max_bytes, used = 0;
+	bool keep;
+	list<Item> items; // most recently used first
+	unordered_map<uint64, list<Item>::iterator> by_content;
+	unordered_map<uint64, uint64> by_perceptual; // to the content key
+	Counters stats;
+	mutable mutex lock;
+};
+
+// Integer SSE2 version of the 0,-1,0/-1,5,-1/0,-1,0 sharpen used by image_enhance,
+// bit-identical to filter2D with BORDER_REFLECT_101 for 8-bit images.
+void sharpen_8u(const Mat& src, Mat& dst);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,397 @@
+// Rectification daemon and its load generator, one binary with two modes:
+//   PPTRestoreDaemon serve <socket> [workers]
+//   PPTRestoreDaemon load <socket> <input> <output> <connections> <seconds>
+// The daemon keeps warmed PPTRestore workers behind AsyncRestore's bounded
+// job queue and speaks a line protocol on a Unix domain socket:
+//   request:  <id> <input> <output>
+//   response: <id> ok|low <confidence> x0 y0 x1 y1 x2 y2 x3 y3
+//             <id> err <message>
+//             <id> busy
+// <input> is an image path or shm:<name>:<width>x<height>x<channels>[:<stride>]
+// naming a POSIX shared memory object; <output> is an image path, a shm: spec
+// (the slide is stretched over that image) or - for the quad alone. "low"
+// means the confidence was below min_confidence and nothing was written,
+// "busy" that the queue was full and the request can be sent again.
+// Paths can't contain spaces.
+#include "PPTRestoreAsync.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <thread>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// line reader and writer over a connected socket, writes may come from any thread
+class Connection
+{
+public:
+	explicit Connection(int fd) : fd(fd) {}
+	~Connection() { close(fd); }
+	bool read_line(string& line);
+	bool write_line(const string& line);
+private:
+	int fd;
+	string buffer;
+	mutex write_lock;
+};
+
+bool Connection::read_line(string& line)
+{
+	for (;;)
+	{
+		size_t end = buffer.find('\n');
+		if (end != string::npos)
+		{
+			line = buffer.substr(0, end);
+			buffer.erase(0, end + 1);
+			return true;
+		}
+		char chunk[4096];
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0) return false;
+		buffer.append(chunk, n);
+	}
+}
+
+bool Connection::write_line(const string& line)
+{
+	lock_guard<mutex> guard(write_lock);
+	string data = line + '\n';
+	for (size_t sent = 0; sent < data.size();)
+	{
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+		if (n <= 0) return false;
+		sent += n;
+	}
+	return true;
+}
+
+// a POSIX shared memory object mapped as an image
+struct SharedImage
+{
+	void* base = MAP_FAILED;
+	size_t length = 0;
+	PPTRestore::ImageView view;
+
+	bool open(const string& spec, bool writable);
+	~SharedImage()
+	{
+		if (base != MAP_FAILED) munmap(base, length);
+	}
+};
+
+bool SharedImage::open(const string& spec, bool writable)
+{
+	size_t colon = spec.find(':', 4);
+	if (colon == string::npos) return false;
+	string name = spec.substr(4, colon - 4);
+	if (name.empty() || name[0] != '/') name = '/' + name;
+	int width = 0, height = 0, channels = 0;
+	unsigned long stride = 0;
+	if (sscanf(spec.c_str() + colon + 1, "%dx%dx%d:%lu", &width, &height, &channels, &stride) < 3) return false;
+	if (width <= 0 || height <= 0 || (channels != 1 && channels != 3 && channels != 4)) return false;
+	// rows may be padded but never shorter than their pixels, and the whole
+	// image has to fit in a size_t
+	if ((size_t)width > SIZE_MAX / channels) return false;
+	size_t row = (size_t)width * channels;
+	if (!stride) stride = row;
+	if (stride < row || stride > SIZE_MAX / height) return false;
+
+	int fd = shm_open(name.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+	if (fd < 0) return false;
+	struct stat st;
+	length = (size_t)stride * height;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= length)
+		base = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED) return false;
+
+	view.data = (unsigned char*)base;
+	view.width = width;
+	view.height = height;
+	view.stride = stride;
+	view.format = channels == 1 ? PPTRestore::PixelFormat::Gray8 :
+		channels == 3 ? PPTRestore::PixelFormat::BGR8 : PPTRestore::PixelFormat::BGRA8;
+	return true;
+}
+
+// one request and what it maps or decodes, alive until its reply is written
+struct Request
+{
+	string id, input, output;
+	SharedImage shared_in, shared_out;
+	Mat image, dst;
+};
+
+// The protocol over AsyncRestore: images are read or mapped on the
+// connection's thread, detection and warping run on its workers, which
+// answer from the completion callback. A full queue is answered with busy
+// instead of being waited for.
+class Daemon
+{
+public:
+	Daemon(int workers, size_t capacity);
+	void submit(const shared_ptr<Connection>& client, const shared_ptr<Request>& request);
+private:
+	double min_confidence;
+	AsyncRestore pool;
+};
+
+static Mat warmup_frame()
+{
+	Mat frame(720, 1280, CV_8UC3, Scalar(60, 60, 60));
+	rectangle(frame, Point(240, 120), Point(1040, 600), Scalar(235, 235, 235), -1);
+	putText(frame, "warm up", Point(420, 380), FONT_HERSHEY_SIMPLEX, 3, Scalar(20, 20, 20), 5);
+	return frame;
+}
+
+static PPTRestore warmed_prototype()
+{
+	PPTRestore ppt;
+	Mat frame = warmup_frame();
+	ppt.get_points(frame);
+	return ppt;
+}
+
+// OpenCV's messages span several lines, a reply has to stay on one
+static string error_reply(const char* what)
+{
+	string reply = string("err ") + what;
+	replace(reply.begin(), reply.end(), '\n', ' ');
+	replace(reply.begin(), reply.end(), '\r', ' ');
+	return reply;
+}
+
+// the input image, and the output mapping for a shm: output; empty or an error reply
+static string open_request(Request& request)
+{
+	if (request.input.compare(0, 4, "shm:") == 0)
+	{
+		if (!request.shared_in.open(request.input, false)) return "err cannot map " + request.input;
+		request.image = PPTRestore::wrap(request.shared_in.view);
+	}
+	else
+		request.image = imread(request.input);
+	if (request.image.empty()) return "err cannot read " + request.input;
+	if (request.output.compare(0, 4, "shm:") == 0)
+	{
+		if (!request.shared_out.open(request.output, true)) return "err cannot map " + request.output;
+		request.dst = PPTRestore::wrap(request.shared_out.view);
+	}
+	return "";
+}
+
+static string reply_for(const Request& request, AsyncRestore::Result& result, double min_confidence)
+{
+	if (result.error) rethrow_exception(result.error);
+	if (result.cancelled) return "err shutting down";
+	const auto& detection = result.detection;
+	bool found = detection.confidence >= min_confidence;
+	ostringstream reply;
+	reply << (found ? "ok " : "low ") << detection.confidence;
+	for (auto p : detection.points)
+		reply << ' ' << p.x << ' ' << p.y;
+	if (!found || request.output == "-") return reply.str();
+
+	if (result.image.empty()) return "err cannot rectify";
+	if (request.dst.empty() && !imwrite(request.output, result.image)) return "err cannot write " + request.output;
+	return reply.str();
+}
+
+// the prototype has been through one synthetic frame and so has every worker,
+// the first real job doesn't pay for OpenCV's lazy initialisation
+Daemon::Daemon(int workers, size_t capacity) : min_confidence(PPTRestore().min_confidence()), pool(warmed_prototype(), workers, capacity)
+{
+	vector<future<AsyncRestore::Result>> warmup;
+	for (int i = 0; i < workers; ++i)
+		warmup.push_back(pool.submit(warmup_frame()));
+	for (auto& f : warmup)
+		f.wait();
+}
+
+// an exception fails the request, not the daemon
+void Daemon::submit(const shared_ptr<Connection>& client, const shared_ptr<Request>& request)
+{
+	string error;
+	try
+	{
+		error = open_request(*request);
+	}
+	catch (const exception& e)
+	{
+		error = error_reply(e.what());
+	}
+	if (!error.empty())
+	{
+		client->write_line(request->id + ' ' + error);
+		return;
+	}
+
+	double min_confidence = this->min_confidence;
+	auto done = [client, request, min_confidence](AsyncRestore::Result& result) {
+		string reply;
+		try
+		{
+			reply = reply_for(*request, result, min_confidence);
+		}
+		catch (const exception& e)
+		{
+			reply = error_reply(e.what());
+		}
+		catch (...)
+		{
+			reply = "err unknown exception";
+		}
+		client->write_line(request->id + ' ' + reply);
+	};
+	if (!pool.try_submit(request->image, request->dst, request->output != "-", done))
+		client->write_line(request->id + " busy");
+}
+
+static void serve_client(Daemon& daemon, shared_ptr<Connection> client)
+{
+	string line;
+	while (client->read_line(line))
+	{
+		istringstream in(line);
+		auto request = make_shared<Request>();
+		if (in >> request->id >> request->input >> request->output)
+			daemon.submit(client, request);
+		else
+			client->write_line((request->id.empty() ? string("-") : request->id) + " err bad request");
+	}
+}
+
+static int serve(const string& path, int workers)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+	{
+		cerr << "socket path too long" << endl;
+		return 1;
+	}
+	strcpy(addr.sun_path, path.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path.c_str());
+	if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+	{
+		perror(path.c_str());
+		return 1;
+	}
+
+	// one OpenCV thread per image, the workers provide the parallelism
+	auto budget = PPTRestore::set_threading_policy(PPTRestore::ThreadingPolicy::InterImage, workers);
+	Daemon daemon(budget.workers, 4 * budget.workers);
+	cerr << "listening on " << path << " with " << budget.workers << " workers" << endl;
+
+	for (;;)
+	{
+		int client = accept(fd, nullptr, nullptr);
+		if (client < 0)
+		{
+			if (errno == EINTR) continue;
+			perror("accept");
+			break;
+		}
+		thread(serve_client, ref(daemon), make_shared<Connection>(client)).detach();
+	}
+	close(fd);
+	return 1;
+}
+
+static int connect_to(const string& path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// closed loop: every connection sends the next request when the last one is
+// answered, a busy request is sent again and counted apart
+static int load(const string& path, const string& input, const string& output, int connections, double seconds)
+{
+	typedef chrono::steady_clock clock;
+	vector<vector<double>> latencies(max(1, connections));
+	atomic<int> errors(0), busy(0);
+	auto start = clock::now();
+	auto stop = start + chrono::duration_cast<clock::duration>(chrono::duration<double>(seconds));
+	vector<thread> clients;
+	for (int c = 0; c < (int)latencies.size(); ++c)
+		clients.emplace_back([&, c] {
+			int fd = connect_to(path);
+			if (fd < 0)
+			{
+				++errors;
+				return;
+			}
+			Connection conn(fd);
+			string reply;
+			for (int id = 0; clock::now() < stop; ++id)
+			{
+				auto sent = clock::now();
+				if (!conn.write_line(to_string(id) + ' ' + input + ' ' + output) || !conn.read_line(reply))
+				{
+					++errors;
+					return;
+				}
+				if (reply.compare(reply.size() - min<size_t>(reply.size(), 5), 5, " busy") == 0)
+				{
+					++busy;
+					--id;
+					this_thread::sleep_for(chrono::milliseconds(1));
+					continue;
+				}
+				latencies[c].push_back(chrono::duration<double, milli>(clock::now() - sent).count());
+				if (reply.find(" err ") != string::npos) ++errors;
+			}
+		});
+	for (auto& t : clients)
+		t.join();
+	double elapsed = chrono::duration<double>(clock::now() - start).count();
+
+	vector<double> all;
+	for (auto& l : latencies)
+		all.insert(all.end(), l.begin(), l.end());
+	sort(all.begin(), all.end());
+	cout << all.size() << " requests, " << errors << " errors, " << busy << " busy, " << all.size() / elapsed << " images/s" << endl;
+	if (all.empty()) return 1;
+	auto at = [&](double q) { return all[min(all.size() - 1, (size_t)(q * all.size()))]; };
+	cout << "latency ms: p50 " << at(0.5) << ", p90 " << at(0.9) << ", p99 " << at(0.99) << ", max " << all.back() << endl;
+	return errors ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	signal(SIGPIPE, SIG_IGN);
+	string mode = argc > 1 ? argv[1] : "";
+	if (mode == "serve" && argc >= 3)
+		return serve(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+	if (mode == "load" && argc >= 7)
+		return load(argv[2], argv[3], argv[4], atoi(argv[5]), atof(argv[6]));
+	cerr << "usage: " << argv[0] << " serve <socket> [workers]" << endl
+		<< "       " << argv[0] << " load <socket> <input> <output> <connections> <seconds>" << endl;
+	return 2;
+}
+#else
+int main()
+{
+	cerr << "the daemon needs Unix domain sockets and POSIX shared memory" << endl;
+	return 1;
+}
+#endif
@@ -0,0 +1,452 @@
+// Python module "pptrestore". Images go in as anything with the buffer
+// protocol (NumPy arrays from cv2 among them) and are wrapped, not copied;
+// results come back as NumPy arrays viewing the result Mat, again without a
+// copy. Detection and warping run with the GIL released, process_batch spreads
+// a list of images over AsyncRestore's worker threads.
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "PPTRestoreClassHead.h"
+#include "PPTRestoreAsync.h"
+
+// holds a Mat and exports its pixels through the buffer protocol
+struct MatBufferObject
+{
+	PyObject_HEAD
+	Mat* mat;
+	Py_ssize_t shape[3];
+	Py_ssize_t strides[3];
+};
+
+static PyObject* mat_buffer_type = nullptr;
+
+static void mat_buffer_dealloc(PyObject* self)
+{
+	delete ((MatBufferObject*)self)->mat;
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+static int mat_buffer_getbuffer(PyObject* self, Py_buffer* view, int flags)
+{
+	auto m = (MatBufferObject*)self;
+	if (!(flags & PyBUF_STRIDES) && !m->mat->isContinuous())
+	{
+		PyErr_SetString(PyExc_BufferError, "image rows are not contiguous");
+		return -1;
+	}
+	view->obj = self;
+	Py_INCREF(self);
+	view->buf = m->mat->data;
+	view->len = (Py_ssize_t)(m->mat->total() * m->mat->elemSize());
+	view->readonly = 0;
+	view->itemsize = 1;
+	view->format = (flags & PyBUF_FORMAT) ? (char*)"B" : nullptr;
+	view->ndim = m->mat->channels() == 1 ? 2 : 3;
+	view->shape = (flags & PyBUF_ND) ? m->shape : nullptr;
+	view->strides = (flags & PyBUF_STRIDES) ? m->strides : nullptr;
+	view->suboffsets = nullptr;
+	view->internal = nullptr;
+	return 0;
+}
+
+static PyType_Slot mat_buffer_slots[] = {
+	{ Py_tp_dealloc, (void*)mat_buffer_dealloc },
+	{ Py_bf_getbuffer, (void*)mat_buffer_getbuffer },
+	{ 0, nullptr }
+};
+
+static PyType_Spec mat_buffer_spec = {
+	"pptrestore._MatBuffer", sizeof(MatBufferObject), 0, Py_TPFLAGS_DEFAULT, mat_buffer_slots
+};
+
+// ndarray sharing the Mat's pixels; a memoryview if NumPy isn't installed
+static PyObject* to_array(const Mat& mat)
+{
+	auto obj = PyObject_New(MatBufferObject, (PyTypeObject*)mat_buffer_type);
+	if (!obj) return nullptr;
+	obj->mat = new Mat(mat);
+	obj->shape[0] = mat.rows, obj->shape[1] = mat.cols, obj->shape[2] = mat.channels();
+	obj->strides[0] = (Py_ssize_t)mat.step[0], obj->strides[1] = mat.channels(), obj->strides[2] = 1;
+
+	PyObject* numpy = PyImport_ImportModule("numpy");
+	if (!numpy)
+	{
+		PyErr_Clear();
+		PyObject* view = PyMemoryView_FromObject((PyObject*)obj);
+		Py_DECREF(obj);
+		return view;
+	}
+	PyObject* array = PyObject_CallMethod(numpy, "asarray", "O", (PyObject*)obj);
+	Py_DECREF(numpy);
+	Py_DECREF(obj);
+	return array;
+}
+
+// a borrowed 8-bit image: HxW, HxWx1, HxWx3 (BGR) or HxWx4 (BGRA), rows may be strided
+struct InputBuffer
+{
+	Py_buffer buffer;
+	bool acquired = false;
+	PPTRestore::ImageView view;
+
+	InputBuffer() {}
+	InputBuffer(const InputBuffer&) = delete;
+	InputBuffer& operator=(const InputBuffer&) = delete;
+
+	bool acquire(PyObject* obj, bool writable)
+	{
+		if (PyObject_GetBuffer(obj, &buffer, writable ? PyBUF_RECORDS : PyBUF_RECORDS_RO) < 0) return false;
+		acquired = true;
+		const int channels = buffer.ndim == 3 ? (int)buffer.shape[2] : 1;
+		bool ok = buffer.itemsize == 1 && (!buffer.format || strcmp(buffer.format, "B") == 0)
+			&& (buffer.ndim == 2 || buffer.ndim == 3) && (channels == 1 || channels == 3 || channels == 4)
+			&& buffer.strides[buffer.ndim - 1] == 1 && (buffer.ndim == 2 || buffer.strides[1] == channels)
+			&& buffer.strides[0] >= buffer.shape[1] * channels;
+		if (!ok)
+		{
+			PyErr_SetString(PyExc_ValueError, "expected a uint8 image of shape (h, w), (h, w, 1), (h, w, 3) or (h, w, 4) with packed pixels");
+			return false;
+		}
+		view.data = (unsigned char*)buffer.buf;
+		view.height = (int)buffer.shape[0];
+		view.width = (int)buffer.shape[1];
+		view.stride = (size_t)buffer.strides[0];
+		view.format = channels == 1 ? PPTRestore::PixelFormat::Gray8 :
+			channels == 3 ? PPTRestore::PixelFormat::BGR8 : PPTRestore::PixelFormat::BGRA8;
+		return true;
+	}
+
+	~InputBuffer()
+	{
+		if (acquired) PyBuffer_Release(&buffer);
+	}
+};
+
+static PyObject* points_to_list(const vector<Point2f>& points)
+{
+	PyObject* list = PyList_New(points.size());
+	for (size_t i = 0; i < points.size(); ++i)
+		PyList_SET_ITEM(list, i, Py_BuildValue("(dd)", (double)points[i].x, (double)points[i].y));
+	return list;
+}
+
+static bool list_to_points(PyObject* obj, vector<Point2f>& points)
+{
+	PyObject* seq = PySequence_Fast(obj, "points must be a sequence of 4 (x, y) pairs");
+	if (!seq) return false;
+	bool ok = PySequence_Fast_GET_SIZE(seq) == 4;
+	for (Py_ssize_t i = 0; ok && i < 4; ++i)
+	{
+		double x, y;
+		ok = PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "dd", &x, &y) != 0;
+		points.emplace_back((float)x, (float)y);
+	}
+	Py_DECREF(seq);
+	if (!ok && !PyErr_Occurred())
+		PyErr_SetString(PyExc_ValueError, "points must be a sequence of 4 (x, y) pairs");
+	return ok;
+}
+
+static PyObject* detection_to_dict(const PPTRestore::Detection& d)
+{
+	PyObject* points = points_to_list(d.points);
+	PyObject* dict = Py_BuildValue("{s:O,s:d,s:O,s:O,s:i}",
+		"points", points, "confidence", d.confidence,
+		"fallback", d.fallback ? Py_True : Py_False, "truncated", d.truncated ? Py_True : Py_False,
+		"verified_corners", d.verified_corners);
+	Py_DECREF(points);
+	return dict;
+}
+
+// A PPTRestore keeps per-image state, so calls on one object from several
+// Python threads take turns on its mutex. It is taken after the GIL has been
+// released and given back before the GIL is taken again, so a thread waiting
+// for it never blocks the interpreter.
+struct RestoreObject
+{
+	PyObject_HEAD
+	PPTRestore* ppt;
+	mutex* lock;
+};
+
+// runs work with the GIL released and the object's mutex held; a C++
+// exception must not cross Py_END_ALLOW_THREADS, it comes back as
+// RuntimeError once the GIL is held again
+template<class F>
+static bool without_gil(PyObject* self, F work)
+{
+	if (!((RestoreObject*)self)->ppt)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "PPTRestore.__init__ was not called");
+		return false;
+	}
+	bool failed = false;
+	string error;
+	mutex& lock = *((RestoreObject*)self)->lock;
+	Py_BEGIN_ALLOW_THREADS
+	try
+	{
+		lock_guard<mutex> guard(lock);
+		work();
+	}
+	catch (const exception& e)
+	{
+		failed = true;
+		error = e.what();
+	}
+	catch (...)
+	{
+		failed = true;
+		error = "unknown C++ exception";
+	}
+	Py_END_ALLOW_THREADS
+	if (failed) PyErr_SetString(PyExc_RuntimeError, error.c_str());
+	return !failed;
+}
+
+static int restore_init(PyObject* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = { nullptr };
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**)kwlist)) return -1;
+	auto r = (RestoreObject*)self;
+	if (!r->lock) r->lock = new mutex();
+	// a second __init__ resets the object in place, other threads may hold the pointer
+	lock_guard<mutex> guard(*r->lock);
+	if (r->ppt) *r->ppt = PPTRestore();
+	else r->ppt = new PPTRestore();
+	return 0;
+}
+
+static void restore_dealloc(PyObject* self)
+{
+	delete ((RestoreObject*)self)->ppt;
+	delete ((RestoreObject*)self)->lock;
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+static PyObject* restore_detect(PyObject* self, PyObject* args)
+{
+	PyObject* image;
+	double budget_ms = 0;
+	if (!PyArg_ParseTuple(args, "O|d", &image, &budget_ms)) return nullptr;
+	InputBuffer input;
+	if (!input.acquire(image, false)) return nullptr;
+	PPTRestore::Detection detection;
+	if (!without_gil(self, [&] { detection = ((RestoreObject*)self)->ppt->detect(input.view, budget_ms); })) return nullptr;
+	return detection_to_dict(detection);
+}
+
+static PyObject* restore_get_points(PyObject* self, PyObject* args)
+{
+	PyObject* image;
+	double budget_ms = 0;
+	if (!PyArg_ParseTuple(args, "O|d", &image, &budget_ms)) return nullptr;
+	InputBuffer input;
+	if (!input.acquire(image, false)) return nullptr;
+	// through the ImageView overload, which keeps no header on the caller's buffer
+	PPTRestore::Detection detection;
+	if (!without_gil(self, [&] { detection = ((RestoreObject*)self)->ppt->detect(input.view, budget_ms); })) return nullptr;
+	return points_to_list(detection.points);
+}
+
+// get_image(image, points[, out]): without out a new array at the quad's own
+// size, with out the result is written into it and out is returned
+static PyObject* restore_get_image(PyObject* self, PyObject* args)
+{
+	PyObject *image, *points_obj, *out = nullptr;
+	if (!PyArg_ParseTuple(args, "OO|O", &image, &points_obj, &out)) return nullptr;
+	vector<Point2f> points;
+	if (!list_to_points(points_obj, points)) return nullptr;
+	InputBuffer input;
+	if (!input.acquire(image, false)) return nullptr;
+	PPTRestore* ppt = ((RestoreObject*)self)->ppt;
+
+	if (out && out != Py_None)
+	{
+		InputBuffer output;
+		if (!output.acquire(out, true)) return nullptr;
+		bool ok = false;
+		if (!without_gil(self, [&] { ok = ppt->get_image(input.view, points, output.view); })) return nullptr;
+		if (!ok)
+		{
+			PyErr_SetString(PyExc_ValueError, "could not rectify into out");
+			return nullptr;
+		}
+		Py_INCREF(out);
+		return out;
+	}
+
+	Mat result;
+	bool ok = without_gil(self, [&] {
+		Mat mat = PPTRestore::wrap(input.view);
+		result = ppt->get_image(mat, points);
+	});
+	if (!ok) return nullptr;
+	return to_array(result);
+}
+
+// restore(image) -> (detection, image or None below min_confidence)
+static PyObject* restore_restore(PyObject* self, PyObject* args)
+{
+	PyObject* image;
+	if (!PyArg_ParseTuple(args, "O", &image)) return nullptr;
+	InputBuffer input;
+	if (!input.acquire(image, false)) return nullptr;
+	PPTRestore* ppt = ((RestoreObject*)self)->ppt;
+	PPTRestore::Detection detection;
+	Mat result;
+	bool ok = without_gil(self, [&] {
+		detection = ppt->detect(input.view);
+		if (detection.confidence >= ppt->min_confidence())
+		{
+			Mat mat = PPTRestore::wrap(input.view);
+			result = ppt->get_image(mat, detection.points);
+		}
+	});
+	if (!ok) return nullptr;
+	PyObject* dict = detection_to_dict(detection);
+	PyObject* array = result.empty() ? (Py_INCREF(Py_None), Py_None) : to_array(result);
+	if (!array)
+	{
+		Py_DECREF(dict);
+		return nullptr;
+	}
+	return Py_BuildValue("(NN)", dict, array);
+}
+
+// process_batch(images[, workers]) -> [(detection, image or None), ...], one
+// AsyncRestore per call so the workers copy the current settings
+static PyObject* restore_process_batch(PyObject* self, PyObject* args)
+{
+	PyObject* images;
+	int workers = 0;
+	if (!PyArg_ParseTuple(args, "O|i", &images, &workers)) return nullptr;
+	PyObject* seq = PySequence_Fast(images, "images must be a sequence");
+	if (!seq) return nullptr;
+	const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+	vector<InputBuffer> inputs(n);
+	for (Py_ssize_t i = 0; i < n; ++i)
+		if (!inputs[i].acquire(PySequence_Fast_GET_ITEM(seq, i), false))
+		{
+			Py_DECREF(seq);
+			return nullptr;
+		}
+
+	// get() rethrows what a worker caught, which fails the whole batch
+	vector<AsyncRestore::Result> results(n);
+	bool ok = without_gil(self, [&] {
+		AsyncRestore pool(*((RestoreObject*)self)->ppt, workers, max<size_t>(1, n));
+		vector<future<AsyncRestore::Result>> pending;
+		for (Py_ssize_t i = 0; i < n; ++i)
+			pending.push_back(pool.submit(PPTRestore::wrap(inputs[i].view)));
+		for (Py_ssize_t i = 0; i < n; ++i)
+			results[i] = pending[i].get();
+	});
+	inputs.clear();
+	Py_DECREF(seq);
+	if (!ok) return nullptr;
+
+	PyObject* list = PyList_New(n);
+	for (Py_ssize_t i = 0; i < n; ++i)
+	{
+		PyObject* array = results[i].image.empty() ? (Py_INCREF(Py_None), Py_None) : to_array(results[i].image);
+		if (!array)
+		{
+			Py_DECREF(list);
+			return nullptr;
+		}
+		PyList_SET_ITEM(list, i, Py_BuildValue("(NN)", detection_to_dict(results[i].detection), array));
+	}
+	return list;
+}
+
+static PyObject* restore_set_min_confidence(PyObject* self, PyObject* args)
+{
+	double confidence;
+	if (!PyArg_ParseTuple(args, "d", &confidence)) return nullptr;
+	if (!without_gil(self, [&] { ((RestoreObject*)self)->ppt->set_min_confidence(confidence); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+static PyObject* restore_set_output_format(PyObject* self, PyObject* args)
+{
+	int format;
+	if (!PyArg_ParseTuple(args, "i", &format)) return nullptr;
+	if (!without_gil(self, [&] { ((RestoreObject*)self)->ppt->set_output_format((PPTRestore::OutputFormat)format); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+static PyObject* restore_set_enhance_mode(PyObject* self, PyObject* args)
+{
+	int mode;
+	if (!PyArg_ParseTuple(args, "i", &mode)) return nullptr;
+	if (!without_gil(self, [&] { ((RestoreObject*)self)->ppt->set_enhance_mode((PPTRestore::EnhanceMode)mode); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+static PyObject* restore_set_corner_refine(PyObject* self, PyObject* args)
+{
+	int enable;
+	if (!PyArg_ParseTuple(args, "p", &enable)) return nullptr;
+	if (!without_gil(self, [&] { ((RestoreObject*)self)->ppt->set_corner_refine(enable != 0); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef restore_methods[] = {
+	{ "detect", restore_detect, METH_VARARGS, "detect(image[, budget_ms]) -> dict" },
+	{ "get_points", restore_get_points, METH_VARARGS, "get_points(image[, budget_ms]) -> [(x, y)] * 4" },
+	{ "get_image", restore_get_image, METH_VARARGS, "get_image(image, points[, out]) -> array" },
+	{ "restore", restore_restore, METH_VARARGS, "restore(image) -> (dict, array or None)" },
+	{ "process_batch", restore_process_batch, METH_VARARGS, "process_batch(images[, workers]) -> [(dict, array or None)]" },
+	{ "set_min_confidence", restore_set_min_confidence, METH_VARARGS, nullptr },
+	{ "set_output_format", restore_set_output_format, METH_VARARGS, "COLOR, GRAY or BINARY" },
+	{ "set_enhance_mode", restore_set_enhance_mode, METH_VARARGS, "SHARPEN, UNSHARP_MASK, LOCAL_CONTRAST or FLATTEN_BACKGROUND" },
+	{ "set_corner_refine", restore_set_corner_refine, METH_VARARGS, nullptr },
+	{ nullptr, nullptr, 0, nullptr }
+};
+
+static PyType_Slot restore_slots[] = {
+	{ Py_tp_init, (void*)restore_init },
+	{ Py_tp_dealloc, (void*)restore_dealloc },
+	{ Py_tp_methods, (void*)restore_methods },
+	{ Py_tp_new, (void*)PyType_GenericNew },
+	{ 0, nullptr }
+};
+
+static PyType_Spec restore_spec = {
+	"pptrestore.PPTRestore", sizeof(RestoreObject), 0, Py_TPFLAGS_DEFAULT, restore_slots
+};
+
+static PyModuleDef module_def = {
+	PyModuleDef_HEAD_INIT, "pptrestore", "Slide detection and rectification.", -1, nullptr
+};
+
+PyMODINIT_FUNC PyInit_pptrestore()
+{
+	PyObject* module = PyModule_Create(&module_def);
+	if (!module) return nullptr;
+	mat_buffer_type = PyType_FromSpec(&mat_buffer_spec);
+	PyObject* restore_type = PyType_FromSpec(&restore_spec);
+	if (!mat_buffer_type || !restore_type || PyModule_AddObject(module, "PPTRestore", restore_type) < 0)
+	{
+		Py_XDECREF(restore_type);
+		Py_DECREF(module);
+		return nullptr;
+	}
+
+	const pair<const char*, int> constants[] = {
+		{ "COLOR", (int)PPTRestore::OutputFormat::Color },
+		{ "GRAY", (int)PPTRestore::OutputFormat::Gray },
+		{ "BINARY", (int)PPTRestore::OutputFormat::Binary },
+		{ "SHARPEN", (int)PPTRestore::EnhanceMode::Sharpen },
+		{ "UNSHARP_MASK", (int)PPTRestore::EnhanceMode::UnsharpMask },
+		{ "LOCAL_CONTRAST", (int)PPTRestore::EnhanceMode::LocalContrast },
+		{ "FLATTEN_BACKGROUND", (int)PPTRestore::EnhanceMode::FlattenBackground }
+	};
+	for (auto c : constants)
+		PyModule_AddIntConstant(module, c.first, c.second);
+	return module;
+}
@@ -0,0 +1,19 @@
+#ifndef __TESTS_CHECK_H
+#define __TESTS_CHECK_H
+#include <iostream>
+
+// a failed check is reported and counted, the test goes on; main returns
+// check_failures != 0
+static int check_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+			++check_failures; \
+		} \
+	} while (0)
+
+#endif
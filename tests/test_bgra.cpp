@@ -0,0 +1,64 @@
+#include "PPTRestoreClassHead.h"
+#include "PPTRestoreAsync.h"
+#include "check.h"
+
+// BGRA input through every Mat entry point has to give what the same BGR
+// input gives: gray for Gray and Binary, BGR for Color
+static void check_same(const Mat& bgra_result, const Mat& bgr_result, int channels)
+{
+	CHECK(!bgra_result.empty());
+	CHECK(bgra_result.channels() == channels);
+	CHECK(bgra_result.size() == bgr_result.size() && bgra_result.type() == bgr_result.type());
+	if (bgra_result.size() == bgr_result.size() && bgra_result.type() == bgr_result.type())
+		CHECK(norm(bgra_result, bgr_result, NORM_INF) == 0);
+}
+
+int main()
+{
+	Mat bgr(600, 800, CV_8UC3, Scalar(40, 40, 40)), bgra;
+	const vector<Point> outline = { Point(100, 80), Point(700, 95), Point(690, 520), Point(110, 505) };
+	fillConvexPoly(bgr, outline, Scalar(230, 230, 230));
+	rectangle(bgr, Rect(200, 200, 200, 100), Scalar(20, 90, 200), FILLED);
+	cvtColor(bgr, bgra, COLOR_BGR2BGRA);
+	const vector<Point2f> quad = { Point2f(100, 80), Point2f(700, 95), Point2f(110, 505), Point2f(690, 520) };
+
+	typedef PPTRestore::OutputFormat Format;
+	for (Format format : { Format::Color, Format::Gray, Format::Binary })
+	{
+		const int channels = format == Format::Color ? 3 : 1;
+		PPTRestore ppt;
+		ppt.set_output_format(format);
+		ppt.set_min_confidence(0);
+
+		check_same(ppt.get_image(bgra, quad), ppt.get_image(bgr, quad), channels);
+
+		// the camera model goes through remap instead of warpPerspective
+		{
+			PPTRestore camera = ppt;
+			Mat k = (Mat_<double>(3, 3) << 800, 0, 400, 0, 800, 300, 0, 0, 1);
+			camera.set_camera(k, Mat::zeros(1, 5, CV_64F));
+			check_same(camera.get_image(bgra, quad), camera.get_image(bgr, quad), channels);
+		}
+
+		// AsyncRestore, which process_batch runs on
+		{
+			AsyncRestore pool(ppt, 1, 2);
+			auto from_bgra = pool.submit(bgra), from_bgr = pool.submit(bgr);
+			check_same(from_bgra.get().image, from_bgr.get().image, channels);
+		}
+
+		// detected video frames, then the fixed tables
+		for (bool fixed : { false, true })
+		{
+			PPTRestore video = ppt;
+			if (fixed) CHECK(video.build_fixed_geometry(quad, bgr.size()));
+			Mat from_bgra, from_bgr;
+			CHECK(video.next_frame(bgra, 0, from_bgra).changed);
+			video.reset_slides();
+			CHECK(video.next_frame(bgr, 1, from_bgr).changed);
+			check_same(from_bgra, from_bgr, channels);
+			if (fixed) check_same(video.rectify_fixed(bgra), video.rectify_fixed(bgr), channels);
+		}
+	}
+	return check_failures ? 1 : 0;
+}
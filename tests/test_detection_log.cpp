@@ -0,0 +1,60 @@
+#include "DetectionLog.h"
+#include "check.h"
+#include <cstdio>
+
+int main()
+{
+	const string path = "test_detection_log.bin";
+	const vector<Point2f> quad = { Point2f(100, 50), Point2f(900, 80), Point2f(120, 650), Point2f(880, 600) };
+	{
+		DetectionLog log;
+		CHECK(log.create(path, Size(1920, 1080)));
+		for (int i = 0; i < 4; ++i)
+		{
+			auto record = DetectionLog::make_record(quad, 0.5 * i);
+			record.confidence = 0.9f;
+			CHECK(log.append(record));
+		}
+		// numbered in place of a timestamp
+		CHECK(log.append(DetectionLog::make_record(quad, -1)));
+		// nothing can be read back while writing
+		CHECK(log.size() == 0);
+		CHECK(log.appended() == 5);
+	}
+
+	// a record cut short by a crash is not read
+	FILE* file = fopen(path.c_str(), "ab");
+	CHECK(file != nullptr);
+	if (file)
+	{
+		const char torn[100] = {};
+		fwrite(torn, 1, sizeof(torn), file);
+		fclose(file);
+	}
+
+	DetectionLog log;
+	CHECK(log.open(path));
+	CHECK(log.frame_size() == Size(1920, 1080));
+	CHECK(log.size() == 5);
+	if (log.size() == 5)
+	{
+		CHECK(log[4].timestamp == 4);
+		CHECK(log[1].confidence == 0.9f);
+		CHECK(DetectionLog::points(log[2]) == quad);
+		CHECK(log.find(-1) == -1);
+		CHECK(log.find(0) == 0);
+		CHECK(log.find(1.2) == 2);
+		CHECK(log.find(100) == 4);
+
+		// the homography takes the quad to the whole output
+		vector<Point2f> corners;
+		Size size(400, 300);
+		perspectiveTransform(quad, corners, DetectionLog::homography(log[0], size));
+		const Point2f expected[] = { Point2f(0, 0), Point2f(400, 0), Point2f(0, 300), Point2f(400, 300) };
+		for (int i = 0; i < 4; ++i)
+			CHECK(norm(corners[i] - expected[i]) < 1e-3);
+	}
+	log.close();
+	remove(path.c_str());
+	return check_failures ? 1 : 0;
+}
@@ -0,0 +1,22 @@
+#include "PPTRestoreClassHead.h"
+#include "check.h"
+
+// past about 1024:1 the thumbnail's short side used to round to 0
+int main()
+{
+	for (Size size : { Size(3000, 2), Size(2, 3000), Size(20000, 3) })
+	{
+		Mat strip(size, CV_8UC3, Scalar(40, 40, 40));
+		rectangle(strip, Rect(size.width / 4, size.height / 4, size.width / 2, size.height / 2), Scalar(230, 230, 230), FILLED);
+		PPTRestore ppt;
+		try
+		{
+			ppt.detect(strip);
+		}
+		catch (...)
+		{
+			CHECK(!"detect threw");
+		}
+	}
+	return check_failures ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+#include "PPTRestoreClassHead.h"
+#include "check.h"
+
+// a bright slide on a dark wall, corners listed clockwise from the top left
+static Mat slide_frame(const vector<Point>& outline)
+{
+	Mat frame(600, 800, CV_8UC3, Scalar(40, 40, 40));
+	fillConvexPoly(frame, outline, Scalar(230, 230, 230));
+	return frame;
+}
+
+int main()
+{
+	const vector<Point> outline = { Point(100, 80), Point(700, 95), Point(690, 520), Point(110, 505) };
+	// left_top, right_top, left_down, right_down
+	const vector<Point2f> corners = { Point2f(100, 80), Point2f(700, 95), Point2f(110, 505), Point2f(690, 520) };
+	Mat frame = slide_frame(outline);
+
+	// the outline approximates to a clean quad: no Hough stage
+	{
+		PPTRestore ppt;
+		auto detection = ppt.detect(frame);
+		auto stats = ppt.statistics();
+		CHECK(stats.fast_path_hits == 1);
+		CHECK(stats.hough_path_runs == 0);
+		CHECK(detection.points.size() == 4 && !detection.fallback);
+		for (size_t i = 0; i < min<size_t>(4, detection.points.size()); ++i)
+			CHECK(norm(detection.points[i] - corners[i]) < 4);
+		CHECK(detection.confidence >= ppt.min_confidence());
+	}
+
+	// turned off, the same frame goes through Hough
+	{
+		PPTRestore ppt;
+		ppt.set_contour_fast_path(false);
+		ppt.detect(frame);
+		CHECK(ppt.statistics().fast_path_hits == 0);
+		CHECK(ppt.statistics().hough_path_runs == 1);
+	}
+
+	// a pentagon, and a quad with a corner far from square, are not accepted
+	const vector<Point> pentagon = { Point(100, 80), Point(700, 95), Point(690, 520), Point(400, 560), Point(110, 505) };
+	const vector<Point> skewed = { Point(100, 80), Point(700, 95), Point(330, 520), Point(110, 505) };
+	for (const auto& shape : { pentagon, skewed })
+	{
+		PPTRestore ppt;
+		Mat other = slide_frame(shape);
+		ppt.detect(other);
+		CHECK(ppt.statistics().fast_path_hits == 0);
+		CHECK(ppt.statistics().hough_path_runs == 1);
+	}
+	return check_failures ? 1 : 0;
+}
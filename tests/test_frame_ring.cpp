@@ -0,0 +1,68 @@
+#include "FrameRing.h"
+#include "check.h"
+#include <climits>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+int main()
+{
+	const string name = "ppt_test_ring";
+	FrameRing producer, consumer;
+	CHECK(!producer.create(name, 3, Size(64, 48), 5));
+	CHECK(producer.create(name, 3, Size(64, 48), 3));
+	CHECK(consumer.open(name));
+	CHECK(consumer.slots() == 3 && consumer.size() == Size(64, 48) && consumer.channels() == 3);
+
+	// three frames fill the ring, a fourth has to wait
+	Mat slot;
+	for (int i = 0; i < 3; ++i)
+	{
+		CHECK(producer.begin_write(slot));
+		slot.setTo(Scalar::all(40 * i));
+		producer.end_write(0.5 * i);
+	}
+	CHECK(!producer.begin_write(slot));
+	CHECK(consumer.available() == 3);
+
+	for (int i = 0; i < 3; ++i)
+	{
+		double timestamp = -1;
+		CHECK(consumer.begin_read(slot, &timestamp));
+		CHECK(timestamp == 0.5 * i);
+		CHECK(slot.size() == Size(64, 48) && norm(slot, Scalar::all(40 * i), NORM_INF) == 0);
+		consumer.end_read();
+	}
+	CHECK(!consumer.begin_read(slot));
+	CHECK(producer.begin_write(slot));
+	consumer.close();
+
+#ifndef _WIN32
+	// a header that promises more slots than the object holds is refused
+	int fd = shm_open(("/" + name).c_str(), O_RDWR, 0600);
+	CHECK(fd >= 0);
+	void* p = fd >= 0 ? mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	CHECK(p != MAP_FAILED);
+	if (p != MAP_FAILED)
+	{
+		int* slots = (int*)((char*)p + 8);
+		int saved = *slots;
+		*slots = INT_MAX;
+		CHECK(!consumer.open(name));
+		*slots = saved;
+		CHECK(consumer.open(name));
+		memcpy(p, "NOTARING", 8);
+		CHECK(!consumer.open(name));
+		munmap(p, 4096);
+	}
+	if (fd >= 0) close(fd);
+#endif
+
+	consumer.close();
+	producer.close();
+	FrameRing::remove(name);
+	return check_failures ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+#include "PPTRestoreClassHead.h"
+#include "check.h"
+#include <cfloat>
+
+// LineSet's SSE2 loops against the scalar formulas they vectorise, on sizes
+// that leave every remainder of four
+static void scalar_intersections(const LineSet& set, Point2f lo, Point2f hi, vector<Point2f>& out)
+{
+	const int n = (int)set.size();
+	for (int i = 0; i < n; ++i)
+		for (int j = i + 1; j < n; ++j)
+		{
+			float w = set.a[i] * set.b[j] - set.b[i] * set.a[j];
+			if (fabs(w) <= 1e-6f) continue;
+			float x = (set.b[i] * set.c[j] - set.c[i] * set.b[j]) / w, y = (set.c[i] * set.a[j] - set.a[i] * set.c[j]) / w;
+			if (x >= lo.x && x <= hi.x && y >= lo.y && y <= hi.y)
+				out.emplace_back(x, y);
+		}
+}
+
+static void scalar_distances(const LineSet& set, const vector<Point2f>& pts, vector<float>& out)
+{
+	out.assign(pts.size(), FLT_MAX);
+	for (size_t i = 0; i < pts.size(); ++i)
+		for (size_t j = 0; j < set.size(); ++j)
+			out[i] = min(out[i], fabs(set.a[j] * pts[i].x + set.b[j] * pts[i].y + set.c[j]));
+}
+
+static bool close_to(float x, float y)
+{
+	return fabs(x - y) <= 1e-4f * max(1.f, fabs(y));
+}
+
+static bool same_points(const vector<Point2f>& x, const vector<Point2f>& y)
+{
+	if (x.size() != y.size()) return false;
+	for (size_t i = 0; i < x.size(); ++i)
+		if (!close_to(x[i].x, y[i].x) || !close_to(x[i].y, y[i].y)) return false;
+	return true;
+}
+
+int main()
+{
+	RNG rng(36);
+	const Point2f lo(-50, -50), hi(1330, 770);
+	for (int n : { 0, 1, 2, 5, 6, 7, 8, 63, 200 })
+	{
+		vector<Vec4f> segments;
+		for (int i = 0; i < n; ++i)
+			segments.emplace_back(rng.uniform(0.f, 1280.f), rng.uniform(0.f, 720.f), rng.uniform(0.f, 1280.f), rng.uniform(0.f, 720.f));
+		// a parallel copy and a degenerate segment meet nothing
+		if (n > 2)
+		{
+			segments[1] = segments[0] + Vec4f(0, 10, 0, 10);
+			segments[2] = Vec4f(segments[2][0], segments[2][1], segments[2][0], segments[2][1]);
+		}
+		LineSet set(segments);
+
+		vector<Point2f> expected, actual;
+		scalar_intersections(set, lo, hi, expected);
+		set.intersect_all(lo, hi, actual);
+		CHECK(same_points(actual, expected));
+
+		// in pieces, as the parallel caller runs it
+		vector<Point2f> pieces;
+		set.intersect_all(lo, hi, pieces, 0, n / 3);
+		set.intersect_all(lo, hi, pieces, n / 3, n);
+		CHECK(same_points(pieces, expected));
+
+		vector<Point2f> pts;
+		for (int i = 0; i < 103; ++i)
+			pts.emplace_back(rng.uniform(0.f, 1280.f), rng.uniform(0.f, 720.f));
+		vector<float> expected_distances, distances;
+		scalar_distances(set, pts, expected_distances);
+		set.min_distances(pts, distances);
+		CHECK(distances.size() == expected_distances.size());
+		for (size_t i = 0; i < min(distances.size(), expected_distances.size()); ++i)
+			CHECK(close_to(distances[i], expected_distances[i]));
+	}
+	return check_failures ? 1 : 0;
+}
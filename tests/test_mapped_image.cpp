@@ -0,0 +1,70 @@
+#include "PPTRestoreClassHead.h"
+#include "MappedImage.h"
+#include "check.h"
+#include <cstdio>
+
+// rectify_mapped reads and writes PPM, which is RGB: its output has to be the
+// BGR pipeline's output in the file's channel order
+int main()
+{
+	Mat frame(360, 480, CV_8UC3, Scalar(30, 30, 30));
+	const vector<Point> slide = { Point(60, 40), Point(420, 55), Point(440, 320), Point(45, 300) };
+	fillConvexPoly(frame, slide, Scalar(235, 235, 235));
+	rectangle(frame, Rect(120, 100, 80, 60), Scalar(0, 0, 220), FILLED);
+	rectangle(frame, Rect(280, 180, 80, 60), Scalar(200, 60, 0), FILLED);
+	CHECK(imwrite("test_mapped_in.ppm", frame));
+
+	// the mapped view keeps the file's order
+	{
+		MappedImage input;
+		CHECK(input.open("test_mapped_in.ppm"));
+		Mat rgb;
+		cvtColor(frame, rgb, COLOR_BGR2RGB);
+		CHECK(input.mat().size() == frame.size() && norm(input.mat(), rgb, NORM_INF) == 0);
+	}
+
+	PPTRestore mapped_ppt, ppt;
+	mapped_ppt.set_min_confidence(0);
+	CHECK(mapped_ppt.rectify_mapped("test_mapped_in.ppm", "test_mapped_out.ppm"));
+	Mat mapped = imread("test_mapped_out.ppm");
+	CHECK(!mapped.empty());
+	if (!mapped.empty())
+	{
+		auto detection = ppt.detect(frame);
+		Mat expected(mapped.size(), CV_8UC3);
+		CHECK(ppt.get_image(PPTRestore::view_of(frame), detection.points, PPTRestore::view_of(expected)));
+		CHECK(norm(mapped, expected, NORM_INF) == 0);
+	}
+	remove("test_mapped_in.ppm");
+	remove("test_mapped_out.ppm");
+
+	// headers that must be refused, not mapped: an empty image and a size
+	// that doesn't fit in an int, each followed by enough pixel bytes
+	const char* bad_headers[] = { "P6\n0 10\n255\n", "P6\n10 0\n255\n", "P6\n99999999999999999999 10\n255\n", "P5\n4294967297 1\n255\n" };
+	for (const char* header : bad_headers)
+	{
+		FILE* file = fopen("test_mapped_bad.ppm", "wb");
+		CHECK(file != nullptr);
+		if (!file) continue;
+		fputs(header, file);
+		const vector<char> pixels(300, 0);
+		fwrite(pixels.data(), 1, pixels.size(), file);
+		fclose(file);
+
+		MappedImage input;
+		CHECK(!input.open("test_mapped_bad.ppm"));
+		PPTRestore bad_ppt;
+		bool rectified = true;
+		try
+		{
+			rectified = bad_ppt.rectify_mapped("test_mapped_bad.ppm", "test_mapped_out.ppm");
+		}
+		catch (...)
+		{
+			CHECK(!"rectify_mapped threw");
+		}
+		CHECK(!rectified);
+	}
+	remove("test_mapped_bad.ppm");
+	return check_failures ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+# BGRA input through every entry point of the pptrestore module has to give
+# what the same BGR input gives: gray for GRAY and BINARY, BGR for COLOR.
+# Plain memoryviews stand in for NumPy arrays, the module needs neither.
+import sys
+import pptrestore
+
+HEIGHT, WIDTH = 600, 800
+QUAD = [(100, 80), (700, 80), (100, 520), (700, 520)]
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        print("FAILED: " + what, file=sys.stderr)
+        failures += 1
+
+
+def image(channels):
+    # a bright slide with a coloured block on a dark wall
+    data = bytearray()
+    for y in range(HEIGHT):
+        for x in range(WIDTH):
+            if 200 <= x < 400 and 200 <= y < 300:
+                pixel = (20, 90, 200)
+            elif 100 <= x < 700 and 80 <= y < 520:
+                pixel = (230, 230, 230)
+            else:
+                pixel = (40, 40, 40)
+            data += bytes(pixel + (255,) * (channels - 3))
+    return memoryview(data).cast("B", (HEIGHT, WIDTH, channels))
+
+
+def channels_of(result):
+    return result.shape[2] if len(result.shape) == 3 else 1
+
+
+def check_same(from_bgra, from_bgr, channels, what):
+    check(from_bgra is not None and from_bgr is not None, what + ": no image")
+    if from_bgra is None or from_bgr is None:
+        return
+    check(channels_of(from_bgra) == channels, what + ": channels")
+    check(tuple(from_bgra.shape) == tuple(from_bgr.shape), what + ": shape")
+    check(bytes(from_bgra) == bytes(from_bgr), what + ": pixels")
+
+
+bgr, bgra = image(3), image(4)
+for name in ("COLOR", "GRAY", "BINARY"):
+    channels = 3 if name == "COLOR" else 1
+    ppt = pptrestore.PPTRestore()
+    ppt.set_output_format(getattr(pptrestore, name))
+    ppt.set_min_confidence(0)
+
+    check_same(ppt.get_image(bgra, QUAD), ppt.get_image(bgr, QUAD), channels, name + " get_image")
+    check_same(ppt.restore(bgra)[1], ppt.restore(bgr)[1], channels, name + " restore")
+    batch = ppt.process_batch([bgra, bgr], 2)
+    check_same(batch[0][1], batch[1][1], channels, name + " process_batch")
+
+    out = memoryview(bytearray(240 * 320 * 4)).cast("B", (240, 320, 4))
+    check(ppt.get_image(bgra, QUAD, out) is out, name + " get_image into out")
+
+sys.exit(1 if failures else 0)
@@ -0,0 +1,29 @@
+#include "PPTRestoreClassHead.h"
+#include "check.h"
+
+// sharpen_8u has to give filter2D's pixels, borders included
+int main()
+{
+	RNG rng(29);
+	Mat kernel = (Mat_<float>(3, 3) << 0, -1, 0, -1, 5, -1, 0, -1, 0);
+	const Size sizes[] = { Size(1, 1), Size(2, 2), Size(3, 7), Size(17, 5), Size(64, 48), Size(333, 101) };
+	for (Size size : sizes)
+		for (int cn : { 1, 3, 4 })
+		{
+			Mat src(size, CV_8UC(cn)), expected, actual;
+			rng.fill(src, RNG::UNIFORM, 0, 256);
+			filter2D(src, expected, src.depth(), kernel);
+			sharpen_8u(src, actual);
+			CHECK(actual.size() == src.size() && actual.type() == src.type());
+			CHECK(norm(expected, actual, NORM_INF) == 0);
+		}
+
+	// a view with padded rows; its border is its own, as for a copy of it
+	Mat big(120, 160, CV_8UC3), expected, actual;
+	rng.fill(big, RNG::UNIFORM, 0, 256);
+	Mat view = big(Rect(13, 7, 101, 77));
+	filter2D(view.clone(), expected, view.depth(), kernel);
+	sharpen_8u(view, actual);
+	CHECK(norm(expected, actual, NORM_INF) == 0);
+	return check_failures ? 1 : 0;
+}
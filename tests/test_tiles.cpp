@@ -0,0 +1,55 @@
+#include "PPTRestoreClassHead.h"
+#include "check.h"
+
+// A slide rectified in bands of rows, each enhanced with enhance_margin rows of
+// context, has to come out exactly as one pass over the whole slide. CLAHE and
+// the background estimate need the whole slide and must ignore the tile height.
+static Mat rectify(PPTRestore& ppt, Mat& src, const vector<Point2f>& quad, int tile_rows, int channels)
+{
+	Mat dst(240, 320, CV_8UC(channels));
+	ppt.set_tile_rows(tile_rows);
+	CHECK(ppt.get_image(PPTRestore::view_of(src), quad, PPTRestore::view_of(dst)));
+	return dst;
+}
+
+int main()
+{
+	typedef PPTRestore::EnhanceMode Mode;
+	typedef PPTRestore::OutputFormat Format;
+	struct Case
+	{
+		Mode mode;
+		Format format;
+		int channels; // of the destination
+	};
+	const Case cases[] = {
+		{ Mode::Sharpen, Format::Color, 3 },
+		{ Mode::UnsharpMask, Format::Color, 3 },
+		{ Mode::Sharpen, Format::Color, 4 },
+		{ Mode::Sharpen, Format::Gray, 1 },
+		{ Mode::Sharpen, Format::Binary, 1 },
+		{ Mode::UnsharpMask, Format::Binary, 1 },
+		{ Mode::LocalContrast, Format::Color, 3 },
+		{ Mode::LocalContrast, Format::Gray, 1 },
+		{ Mode::FlattenBackground, Format::Color, 3 },
+		{ Mode::FlattenBackground, Format::Binary, 1 }
+	};
+
+	RNG rng(31);
+	Mat src(480, 640, CV_8UC3);
+	rng.fill(src, RNG::UNIFORM, 0, 256);
+	// some structure for the threshold to find
+	GaussianBlur(src, src, Size(5, 5), 1.5);
+	const vector<Point2f> quad = { Point2f(70, 40), Point2f(590, 65), Point2f(50, 430), Point2f(600, 455) };
+
+	for (const auto& c : cases)
+	{
+		PPTRestore ppt;
+		ppt.set_enhance_mode(c.mode);
+		ppt.set_output_format(c.format);
+		Mat whole = rectify(ppt, src, quad, 1 << 20, c.channels);
+		for (int rows : { 1, 7, 32, 100 })
+			CHECK(norm(whole, rectify(ppt, src, quad, rows, c.channels), NORM_INF) == 0);
+	}
+	return check_failures ? 1 : 0;
+}